@@ -0,0 +1,460 @@
+/*
+ * kbd-backlight-bench - Synthetic load benchmark for kbd-backlight-daemon
+ *
+ * Creates a virtual keyboard, mouse and touchpad through /dev/uinput, points
+ * the daemon at a fake backlight on tmpfs and runs it through scripted input
+ * scenarios. For each scenario it reports wakeups per second, CPU time, sysfs
+ * writes and input-to-light latency, taken from the daemon's metrics dump and
+ * from getrusage on the child. An allow rule on the virtual devices' vendor
+ * id keeps the machine's real input devices out of the measurement.
+ *
+ * Needs write access to /dev/uinput (usually root).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <linux/input.h>
+#include <linux/uinput.h>
+
+#define UINPUT_PATH "/dev/uinput"
+#define DEFAULT_DAEMON "./kbd-backlight-daemon"
+#define MAX_BRIGHTNESS 100
+#define TARGET_BRIGHTNESS 50
+#define STARTUP_MS 500   /* Time given to the daemon to open the devices */
+#define BENCH_VENDOR 0x1209  /* Vendor id of the virtual devices; the daemon is limited to it */
+
+enum vdev { VDEV_KEYBOARD, VDEV_MOUSE, VDEV_TOUCHPAD, VDEV_COUNT };
+
+typedef struct {
+    const char *name;
+    const char *description;
+    double timeout;          /* Daemon dim timeout in seconds */
+    long long duration_ms;   /* Base duration, scaled by -d */
+    void (*run)(long long end_us);
+} Scenario;
+
+typedef struct {
+    unsigned long wakeups;
+    unsigned long sysfs_reads;
+    unsigned long sysfs_writes;
+    unsigned long latency_samples;
+    double latency_p50_ms;
+    double latency_p99_ms;
+} DaemonMetrics;
+
+static int vdev_fd[VDEV_COUNT] = { -1, -1, -1 };
+static char work_dir[64];
+static const char *daemon_path = DEFAULT_DAEMON;
+static const char *backend = "epoll";
+static double duration_scale = 1.0;
+
+static long long now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void sleep_until_us(long long t_us) {
+    struct timespec ts = { t_us / 1000000, (t_us % 1000000) * 1000 };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+static void emit(enum vdev dev, int type, int code, int value) {
+    struct input_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.type = type;
+    ev.code = code;
+    ev.value = value;
+    if (write(vdev_fd[dev], &ev, sizeof(ev)) < 0 && errno != EAGAIN) {
+        perror("write uinput");
+    }
+}
+
+static void syn(enum vdev dev) {
+    emit(dev, EV_SYN, SYN_REPORT, 0);
+}
+
+static void key_tap(int code) {
+    emit(VDEV_KEYBOARD, EV_KEY, code, 1);
+    syn(VDEV_KEYBOARD);
+    emit(VDEV_KEYBOARD, EV_KEY, code, 0);
+    syn(VDEV_KEYBOARD);
+}
+
+static void mouse_move(int dx, int dy) {
+    emit(VDEV_MOUSE, EV_REL, REL_X, dx);
+    emit(VDEV_MOUSE, EV_REL, REL_Y, dy);
+    syn(VDEV_MOUSE);
+}
+
+static void touchpad_move(int x, int y) {
+    emit(VDEV_TOUCHPAD, EV_ABS, ABS_X, x);
+    emit(VDEV_TOUCHPAD, EV_ABS, ABS_Y, y);
+    syn(VDEV_TOUCHPAD);
+}
+
+static void touchpad_contact(int down) {
+    emit(VDEV_TOUCHPAD, EV_KEY, BTN_TOUCH, down);
+    emit(VDEV_TOUCHPAD, EV_KEY, BTN_TOOL_FINGER, down);
+    syn(VDEV_TOUCHPAD);
+}
+
+/* Emit `report` every period_us until end_us, catching up in bursts when late */
+static void run_periodic(long long period_us, long long end_us, void (*report)(long long n)) {
+    long long next = now_us();
+    long long n = 0;
+    while (next < end_us) {
+        sleep_until_us(next);
+        long long now = now_us();
+        while (next <= now && next < end_us) {
+            report(n++);
+            next += period_us;
+        }
+    }
+}
+
+static const int typing_keys[] = { KEY_H, KEY_E, KEY_L, KEY_L, KEY_O, KEY_SPACE, KEY_W, KEY_O, KEY_R, KEY_L, KEY_D };
+
+static void typing_report(long long n) {
+    key_tap(typing_keys[n % (long long)(sizeof(typing_keys) / sizeof(typing_keys[0]))]);
+}
+
+static void mouse_report(long long n) {
+    mouse_move(n & 1 ? 1 : -1, 0);
+}
+
+static void touchpad_report(long long n) {
+    touchpad_move(500 + (int)(n % 200), 500);
+}
+
+/* Steady typing at 10 keys per second */
+static void scenario_typing(long long end_us) {
+    run_periodic(100000, end_us, typing_report);
+}
+
+/* Gaming mouse polled at 8 kHz */
+static void scenario_mouse_8khz(long long end_us) {
+    run_periodic(125, end_us, mouse_report);
+}
+
+/* Alternating touchpad swipes, typing bursts and pauses long enough to dim */
+static void scenario_bursty(long long end_us) {
+    while (now_us() < end_us) {
+        long long t = now_us();
+        touchpad_contact(1);
+        run_periodic(1000, t + 800000 < end_us ? t + 800000 : end_us, touchpad_report);
+        touchpad_contact(0);
+        t = now_us();
+        run_periodic(50000, t + 500000 < end_us ? t + 500000 : end_us, typing_report);
+        t = now_us() + 2000000;
+        sleep_until_us(t < end_us ? t : end_us);
+    }
+}
+
+/* No input at all: measures the idle wakeup floor */
+static void scenario_idle(long long end_us) {
+    sleep_until_us(end_us);
+}
+
+/* One keypress after every dim: measures undim latency and fade churn */
+static void scenario_dim_undim(long long end_us) {
+    while (now_us() < end_us) {
+        key_tap(KEY_SPACE);
+        long long t = now_us() + 1000000;
+        sleep_until_us(t < end_us ? t : end_us);
+    }
+}
+
+static const Scenario scenarios[] = {
+    { "typing",     "10 keys/s on the keyboard",                 1.0,  5000, scenario_typing },
+    { "mouse-8khz", "8000 reports/s from the mouse",             1.0,  5000, scenario_mouse_8khz },
+    { "bursty",     "touchpad swipes, typing bursts and pauses", 1.0, 10000, scenario_bursty },
+    { "idle",       "no input",                                  1.0, 10000, scenario_idle },
+    { "dim-undim",  "one keypress per second, 0.5s timeout",     0.5, 10000, scenario_dim_undim },
+};
+
+#define SCENARIO_COUNT (int)(sizeof(scenarios) / sizeof(scenarios[0]))
+
+static int uinput_create(enum vdev dev) {
+    static const char *names[VDEV_COUNT] = {
+        "kbd-backlight-bench keyboard", "kbd-backlight-bench mouse", "kbd-backlight-bench touchpad"
+    };
+    int fd = open(UINPUT_PATH, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to open %s: %s\n", UINPUT_PATH, strerror(errno));
+        return -1;
+    }
+
+    switch (dev) {
+    case VDEV_KEYBOARD:
+        ioctl(fd, UI_SET_EVBIT, EV_KEY);
+        for (int code = KEY_ESC; code <= KEY_KPDOT; code++) {
+            ioctl(fd, UI_SET_KEYBIT, code);
+        }
+        break;
+    case VDEV_MOUSE:
+        ioctl(fd, UI_SET_EVBIT, EV_KEY);
+        ioctl(fd, UI_SET_KEYBIT, BTN_LEFT);
+        ioctl(fd, UI_SET_KEYBIT, BTN_RIGHT);
+        ioctl(fd, UI_SET_EVBIT, EV_REL);
+        ioctl(fd, UI_SET_RELBIT, REL_X);
+        ioctl(fd, UI_SET_RELBIT, REL_Y);
+        break;
+    case VDEV_TOUCHPAD:
+        ioctl(fd, UI_SET_EVBIT, EV_KEY);
+        ioctl(fd, UI_SET_KEYBIT, BTN_TOUCH);
+        ioctl(fd, UI_SET_KEYBIT, BTN_TOOL_FINGER);
+        ioctl(fd, UI_SET_KEYBIT, BTN_LEFT);
+        ioctl(fd, UI_SET_EVBIT, EV_ABS);
+        ioctl(fd, UI_SET_PROPBIT, INPUT_PROP_POINTER);
+        for (int code = ABS_X; code <= ABS_Y; code++) {
+            struct uinput_abs_setup abs;
+            memset(&abs, 0, sizeof(abs));
+            abs.code = code;
+            abs.absinfo.maximum = 1000;
+            ioctl(fd, UI_ABS_SETUP, &abs);
+        }
+        break;
+    default:
+        break;
+    }
+
+    struct uinput_setup setup;
+    memset(&setup, 0, sizeof(setup));
+    setup.id.bustype = BUS_VIRTUAL;
+    setup.id.vendor = BENCH_VENDOR;
+    setup.id.product = 0x0100 + dev;
+    snprintf(setup.name, sizeof(setup.name), "%s", names[dev]);
+    if (ioctl(fd, UI_DEV_SETUP, &setup) < 0 || ioctl(fd, UI_DEV_CREATE) < 0) {
+        fprintf(stderr, "Failed to create %s: %s\n", names[dev], strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int write_file(const char *dir, const char *name, const char *content) {
+    char path[128];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        fprintf(stderr, "Failed to write %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    fputs(content, f);
+    fclose(f);
+    return 0;
+}
+
+/* Fresh fake backlight and config for one scenario */
+static int prepare_scenario(const Scenario *sc) {
+    char buf[512];
+    snprintf(buf, sizeof(buf), "%d\n", MAX_BRIGHTNESS);
+    if (write_file(work_dir, "max_brightness", buf) < 0) return -1;
+    snprintf(buf, sizeof(buf), "%d\n", TARGET_BRIGHTNESS);
+    if (write_file(work_dir, "brightness", buf) < 0) return -1;
+    /* No event ring or calibration: the system daemon's files are left alone */
+    snprintf(buf, sizeof(buf),
+             "brightness_path=%s/brightness\n"
+             "max_brightness_path=%s/max_brightness\n"
+             "timeout=%g\n"
+             "target_brightness=%d\n"
+             "dim_brightness=0\n"
+             "fade_steps=10\n"
+             "fade_interval_ms=20\n"
+             "allow=id:%04x\n"
+             "event_ring=none\n"
+             "calibration_path=none\n",
+             work_dir, work_dir, sc->timeout, TARGET_BRIGHTNESS, BENCH_VENDOR);
+    return write_file(work_dir, "kbd-backlight-daemon.conf", buf);
+}
+
+static pid_t spawn_daemon(void) {
+    char config[128], log[128];
+    snprintf(config, sizeof(config), "%s/kbd-backlight-daemon.conf", work_dir);
+    snprintf(log, sizeof(log), "%s/daemon.log", work_dir);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        int fd = open(log, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd >= 0) {
+            dup2(fd, STDERR_FILENO);
+            dup2(fd, STDOUT_FILENO);
+            close(fd);
+        }
+        execl(daemon_path, daemon_path, "-f", "-b", backend, "-c", config, (char *)NULL);
+        fprintf(stderr, "Failed to exec %s: %s\n", daemon_path, strerror(errno));
+        _exit(127);
+    }
+    return pid;
+}
+
+static void parse_metrics(DaemonMetrics *m) {
+    char path[128], line[512];
+    snprintf(path, sizeof(path), "%s/daemon.log", work_dir);
+    memset(m, 0, sizeof(*m));
+
+    FILE *f = fopen(path, "r");
+    if (!f) return;
+    while (fgets(line, sizeof(line), f)) {
+        const char *p;
+        if ((p = strstr(line, "  wakeups: ")) != NULL) {
+            sscanf(p, "  wakeups: %lu", &m->wakeups);
+        } else if ((p = strstr(line, "  sysfs: ")) != NULL) {
+            sscanf(p, "  sysfs: %lu reads, %lu writes", &m->sysfs_reads, &m->sysfs_writes);
+        } else if ((p = strstr(line, "input-to-first light latency: ")) != NULL) {
+            sscanf(p, "input-to-first light latency: %lu samples, p50 %lfms, p99 %lfms",
+                   &m->latency_samples, &m->latency_p50_ms, &m->latency_p99_ms);
+        }
+    }
+    fclose(f);
+}
+
+static int run_scenario(const Scenario *sc) {
+    if (prepare_scenario(sc) < 0) return -1;
+
+    pid_t pid = spawn_daemon();
+    if (pid < 0) {
+        perror("fork");
+        return -1;
+    }
+    sleep_until_us(now_us() + STARTUP_MS * 1000LL);
+
+    long long start = now_us();
+    sc->run(start + (long long)(sc->duration_ms * duration_scale) * 1000);
+    double elapsed = (now_us() - start) / 1e6 + STARTUP_MS / 1000.0;
+
+    kill(pid, SIGTERM);
+    int status;
+    struct rusage ru;
+    if (wait4(pid, &status, 0, &ru) < 0) {
+        perror("wait4");
+        return -1;
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "%s: daemon exited abnormally, see %s/daemon.log\n", sc->name, work_dir);
+        return -1;
+    }
+
+    DaemonMetrics m;
+    parse_metrics(&m);
+    double cpu_ms = ru.ru_utime.tv_sec * 1e3 + ru.ru_utime.tv_usec / 1e3 +
+                    ru.ru_stime.tv_sec * 1e3 + ru.ru_stime.tv_usec / 1e3;
+
+    printf("%-11s %9.1f %8.1f %6.2f%% %7lu %7lu", sc->name, m.wakeups / elapsed, cpu_ms,
+           cpu_ms / (elapsed * 10.0), m.sysfs_reads, m.sysfs_writes);
+    if (m.latency_samples > 0) {
+        printf(" %6lu %8.2f %8.2f\n", m.latency_samples, m.latency_p50_ms, m.latency_p99_ms);
+    } else {
+        printf(" %6s %8s %8s\n", "0", "-", "-");
+    }
+    fflush(stdout);
+    return 0;
+}
+
+static void cleanup(void) {
+    for (int i = 0; i < VDEV_COUNT; i++) {
+        if (vdev_fd[i] >= 0) {
+            ioctl(vdev_fd[i], UI_DEV_DESTROY);
+            close(vdev_fd[i]);
+        }
+    }
+    if (work_dir[0] && !getenv("KBD_BENCH_KEEP")) {
+        const char *files[] = { "brightness", "max_brightness", "kbd-backlight-daemon.conf", "daemon.log" };
+        char path[128];
+        for (size_t i = 0; i < sizeof(files) / sizeof(files[0]); i++) {
+            snprintf(path, sizeof(path), "%s/%s", work_dir, files[i]);
+            unlink(path);
+        }
+        rmdir(work_dir);
+    }
+}
+
+static void usage(const char *prog) {
+    printf("Usage: %s [OPTIONS] [SCENARIO...]\n", prog);
+    printf("Options:\n");
+    printf("  -D, --daemon PATH   Daemon binary (default: %s)\n", DEFAULT_DAEMON);
+    printf("  -b, --backend B     Backend passed to the daemon (default: epoll)\n");
+    printf("  -d, --duration X    Scale every scenario's duration by X (default: 1)\n");
+    printf("  -h, --help          Show this help message\n");
+    printf("Scenarios:\n");
+    for (int i = 0; i < SCENARIO_COUNT; i++) {
+        printf("  %-11s %s (%.0fs)\n", scenarios[i].name, scenarios[i].description,
+               scenarios[i].duration_ms / 1000.0);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    int selected[SCENARIO_COUNT] = { 0 };
+    int any_selected = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if ((strcmp(argv[i], "-D") == 0 || strcmp(argv[i], "--daemon") == 0) && i + 1 < argc) {
+            daemon_path = argv[++i];
+        } else if ((strcmp(argv[i], "-b") == 0 || strcmp(argv[i], "--backend") == 0) && i + 1 < argc) {
+            backend = argv[++i];
+        } else if ((strcmp(argv[i], "-d") == 0 || strcmp(argv[i], "--duration") == 0) && i + 1 < argc) {
+            duration_scale = atof(argv[++i]);
+            if (duration_scale <= 0) duration_scale = 1.0;
+        } else if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
+            usage(argv[0]);
+            return 0;
+        } else {
+            int found = 0;
+            for (int s = 0; s < SCENARIO_COUNT; s++) {
+                if (strcmp(argv[i], scenarios[s].name) == 0) {
+                    selected[s] = 1;
+                    any_selected = found = 1;
+                }
+            }
+            if (!found) {
+                fprintf(stderr, "Unknown scenario '%s'\n", argv[i]);
+                usage(argv[0]);
+                return 1;
+            }
+        }
+    }
+
+    if (access(daemon_path, X_OK) < 0) {
+        fprintf(stderr, "Daemon binary %s not found, build it first\n", daemon_path);
+        return 1;
+    }
+
+    /* Fake backlight on tmpfs so sysfs writes cost what they would on real sysfs, not disk I/O */
+    const char *base = access("/dev/shm", W_OK) == 0 ? "/dev/shm" : "/tmp";
+    snprintf(work_dir, sizeof(work_dir), "%s/kbd-backlight-bench.XXXXXX", base);
+    if (!mkdtemp(work_dir)) {
+        perror("mkdtemp");
+        return 1;
+    }
+    atexit(cleanup);
+
+    for (int i = 0; i < VDEV_COUNT; i++) {
+        vdev_fd[i] = uinput_create(i);
+        if (vdev_fd[i] < 0) return 1;
+    }
+    /* Let udev settle the new nodes before the first daemon scans /dev/input */
+    sleep_until_us(now_us() + STARTUP_MS * 1000LL);
+
+    printf("Backend: %s, fake backlight in %s\n", backend, work_dir);
+    printf("%-11s %9s %8s %7s %7s %7s %6s %8s %8s\n", "scenario", "wakeups/s", "cpu ms", "cpu",
+           "reads", "writes", "undims", "p50 ms", "p99 ms");
+
+    int failed = 0;
+    for (int i = 0; i < SCENARIO_COUNT; i++) {
+        if (any_selected && !selected[i]) continue;
+        if (run_scenario(&scenarios[i]) < 0) failed = 1;
+    }
+    return failed;
+}
@@ -0,0 +1,281 @@
+/*
+ * kbd-backlight-bpf - Input activity tracking in the kernel
+ *
+ * See kbd-backlight-bpf.h. No libbpf: the program is a few dozen
+ * instructions assembled here and loaded with the bpf() syscall, and the
+ * kprobe is attached through the perf "kprobe" PMU.
+ *
+ * Array map slots: 0 is the armed mask (bit per event type), 1-3 hold the bpf_ktime_get_ns()
+ * (CLOCK_MONOTONIC) stamp of the last EV_KEY, EV_REL and EV_ABS event; the
+ * slot index is the event type. The map is mmap()ed, so reading stamps and
+ * arming are plain memory accesses.
+ */
+
+#include "kbd-backlight-bpf.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <asm/ptrace.h>
+#include <linux/bpf.h>
+#include <linux/perf_event.h>
+#include <linux/input.h>
+
+/* Offset of input_event()'s second argument (the event type) in the kprobe's pt_regs */
+#if defined(__x86_64__)
+#define ARG2_OFFSET offsetof(struct pt_regs, rsi)
+#elif defined(__aarch64__)
+#define ARG2_OFFSET offsetof(struct user_pt_regs, regs[1])
+#endif
+
+#define KPROBE_FUNC "input_event"
+#define KPROBE_PMU_TYPE "/sys/bus/event_source/devices/kprobe/type"
+#define SLOT_ARMED 0
+#define SLOT_COUNT (EV_ABS + 1)
+#define RINGBUF_SIZE 4096
+#define MAX_INSNS 40
+
+typedef struct {
+    int stamps_fd;
+    int ringbuf_fd;
+    int prog_fd;
+    int perf_fd;
+    volatile uint64_t *slots;           /* mmap of the array map */
+    size_t slots_size;
+    volatile unsigned long *consumer;   /* Ring buffer consumer position (rw page) */
+    volatile unsigned long *producer;   /* Producer position (ro page) */
+    long page_size;
+} BpfTracker;
+
+static BpfTracker bpf = { -1, -1, -1, -1, NULL, 0, NULL, NULL, 0 };
+
+static long sys_bpf(int cmd, union bpf_attr *attr) {
+    return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+static int map_create(enum bpf_map_type type, int value_size, int max_entries, int flags) {
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type = type;
+    attr.key_size = type == BPF_MAP_TYPE_RINGBUF ? 0 : sizeof(uint32_t);
+    attr.value_size = value_size;
+    attr.max_entries = max_entries;
+    attr.map_flags = flags;
+    return (int)sys_bpf(BPF_MAP_CREATE, &attr);
+}
+
+#ifdef ARG2_OFFSET
+typedef struct {
+    struct bpf_insn insns[MAX_INSNS];
+    int count;
+    int exits[8];   /* Jumps to patch to the exit label */
+    int exit_count;
+} Asm;
+
+static void emit(Asm *a, uint8_t code, int dst, int src, int16_t off, int32_t imm) {
+    struct bpf_insn *insn = &a->insns[a->count++];
+    memset(insn, 0, sizeof(*insn));
+    insn->code = code;
+    insn->dst_reg = dst;
+    insn->src_reg = src;
+    insn->off = off;
+    insn->imm = imm;
+}
+
+/* Two-slot load of a map fd, relocated to the map by the kernel */
+static void emit_map_fd(Asm *a, int dst, int fd) {
+    emit(a, BPF_LD | BPF_DW | BPF_IMM, dst, BPF_PSEUDO_MAP_FD, 0, fd);
+    emit(a, 0, 0, 0, 0, 0);
+}
+
+static void emit_jump_exit(Asm *a, uint8_t op, int reg, int32_t imm) {
+    a->exits[a->exit_count++] = a->count;
+    emit(a, BPF_JMP | op | BPF_K, reg, 0, 0, imm);
+}
+
+/* r0 = &slots[*(u32 *)(r10 - 4)], or exit if the lookup fails */
+static void emit_slot_lookup(Asm *a, int map_fd) {
+    emit_map_fd(a, BPF_REG_1, map_fd);
+    emit(a, BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_10, 0, 0);
+    emit(a, BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_2, 0, 0, -4);
+    emit(a, BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_lookup_elem);
+    emit_jump_exit(a, BPF_JEQ, BPF_REG_0, 0);
+}
+
+/*
+ * kprobe on input_event(dev, type, code, value):
+ *     if (type < EV_KEY || type > EV_ABS) return 0;
+ *     now = bpf_ktime_get_ns();
+ *     slots[type] = now;
+ *     if (slots[SLOT_ARMED] & (1 << type)) {
+ *         slots[SLOT_ARMED] = 0;
+ *         bpf_ringbuf_output(&ringbuf, &now, sizeof(now), 0);
+ *     }
+ *     return 0;
+ */
+static int assemble(Asm *a, int stamps_fd, int ringbuf_fd) {
+    memset(a, 0, sizeof(*a));
+    emit(a, BPF_LDX | BPF_MEM | BPF_DW, BPF_REG_2, BPF_REG_1, ARG2_OFFSET, 0);
+    emit(a, BPF_ALU | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_2, 0, 0);   /* unsigned int */
+    emit_jump_exit(a, BPF_JEQ, BPF_REG_2, EV_SYN);
+    emit_jump_exit(a, BPF_JGT, BPF_REG_2, EV_ABS);
+    emit(a, BPF_STX | BPF_MEM | BPF_W, BPF_REG_10, BPF_REG_2, -4, 0);
+    emit(a, BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_7, BPF_REG_2, 0, 0);  /* Survives the calls */
+
+    emit(a, BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_ktime_get_ns);
+    emit(a, BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_6, BPF_REG_0, 0, 0);
+    emit_slot_lookup(a, stamps_fd);
+    emit(a, BPF_STX | BPF_MEM | BPF_DW, BPF_REG_0, BPF_REG_6, 0, 0);
+
+    emit(a, BPF_ST | BPF_MEM | BPF_W, BPF_REG_10, 0, -4, SLOT_ARMED);
+    emit_slot_lookup(a, stamps_fd);
+    emit(a, BPF_LDX | BPF_MEM | BPF_DW, BPF_REG_1, BPF_REG_0, 0, 0);
+    emit(a, BPF_ALU64 | BPF_RSH | BPF_X, BPF_REG_1, BPF_REG_7, 0, 0);
+    emit(a, BPF_ALU64 | BPF_AND | BPF_K, BPF_REG_1, 0, 0, 1);
+    emit_jump_exit(a, BPF_JEQ, BPF_REG_1, 0);
+    emit(a, BPF_ST | BPF_MEM | BPF_DW, BPF_REG_0, 0, 0, 0);
+
+    emit(a, BPF_STX | BPF_MEM | BPF_DW, BPF_REG_10, BPF_REG_6, -16, 0);
+    emit_map_fd(a, BPF_REG_1, ringbuf_fd);
+    emit(a, BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_10, 0, 0);
+    emit(a, BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_2, 0, 0, -16);
+    emit(a, BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_3, 0, 0, sizeof(uint64_t));
+    emit(a, BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_4, 0, 0, 0);
+    emit(a, BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_ringbuf_output);
+
+    int exit_pc = a->count;
+    emit(a, BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, 0);
+    emit(a, BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+    for (int i = 0; i < a->exit_count; i++) {
+        a->insns[a->exits[i]].off = (int16_t)(exit_pc - a->exits[i] - 1);
+    }
+    return a->count;
+}
+
+static int prog_load(int verbose) {
+    Asm a;
+    int count = assemble(&a, bpf.stamps_fd, bpf.ringbuf_fd);
+    static char log[4096];
+
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type = BPF_PROG_TYPE_KPROBE;
+    attr.insns = (uint64_t)(uintptr_t)a.insns;
+    attr.insn_cnt = count;
+    attr.license = (uint64_t)(uintptr_t)"GPL";
+    if (verbose) {
+        attr.log_buf = (uint64_t)(uintptr_t)log;
+        attr.log_size = sizeof(log);
+        attr.log_level = 1;
+    }
+    int fd = (int)sys_bpf(BPF_PROG_LOAD, &attr);
+    if (fd < 0 && verbose && log[0]) {
+        fprintf(stderr, "BPF verifier:\n%s\n", log);
+    }
+    return fd;
+}
+
+static int kprobe_attach(void) {
+    FILE *f = fopen(KPROBE_PMU_TYPE, "r");
+    int type = -1;
+    if (f) {
+        if (fscanf(f, "%d", &type) != 1) type = -1;
+        fclose(f);
+    }
+    if (type < 0) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config1 = (uint64_t)(uintptr_t)KPROBE_FUNC;
+    /* The program runs for hits on every CPU; the perf event itself is per CPU */
+    bpf.perf_fd = (int)syscall(__NR_perf_event_open, &attr, -1, 0, -1, PERF_FLAG_FD_CLOEXEC);
+    if (bpf.perf_fd < 0) return -1;
+    if (ioctl(bpf.perf_fd, PERF_EVENT_IOC_SET_BPF, bpf.prog_fd) < 0 ||
+        ioctl(bpf.perf_fd, PERF_EVENT_IOC_ENABLE, 0) < 0) {
+        return -1;
+    }
+    return 0;
+}
+#endif
+
+int kbd_bpf_open(int verbose) {
+#ifndef ARG2_OFFSET
+    (void)verbose;
+    fprintf(stderr, "BPF activity tracking: not supported on this architecture\n");
+    return -1;
+#else
+    const char *step = "map";
+    bpf.page_size = sysconf(_SC_PAGESIZE);
+    bpf.stamps_fd = map_create(BPF_MAP_TYPE_ARRAY, sizeof(uint64_t), SLOT_COUNT, BPF_F_MMAPABLE);
+    bpf.ringbuf_fd = map_create(BPF_MAP_TYPE_RINGBUF, 0, RINGBUF_SIZE, 0);
+    if (bpf.stamps_fd < 0 || bpf.ringbuf_fd < 0) goto fail;
+
+    step = "mmap";
+    bpf.slots_size = (SLOT_COUNT * sizeof(uint64_t) + bpf.page_size - 1) / bpf.page_size * bpf.page_size;
+    void *p = mmap(NULL, bpf.slots_size, PROT_READ | PROT_WRITE, MAP_SHARED, bpf.stamps_fd, 0);
+    if (p == MAP_FAILED) goto fail;
+    bpf.slots = p;
+    p = mmap(NULL, bpf.page_size, PROT_READ | PROT_WRITE, MAP_SHARED, bpf.ringbuf_fd, 0);
+    if (p == MAP_FAILED) goto fail;
+    bpf.consumer = p;
+    p = mmap(NULL, bpf.page_size, PROT_READ, MAP_SHARED, bpf.ringbuf_fd, bpf.page_size);
+    if (p == MAP_FAILED) goto fail;
+    bpf.producer = p;
+
+    step = "program load";
+    bpf.prog_fd = prog_load(verbose);
+    if (bpf.prog_fd < 0) goto fail;
+
+    step = "kprobe on " KPROBE_FUNC;
+    if (kprobe_attach() < 0) goto fail;
+    return bpf.ringbuf_fd;
+
+fail:
+    fprintf(stderr, "BPF activity tracking unavailable (%s: %s)\n", step, strerror(errno));
+    kbd_bpf_close();
+    return -1;
+#endif
+}
+
+void kbd_bpf_arm(unsigned classes) {
+    uint64_t types = 0;
+    for (int i = 0; i < KBD_BPF_CLASS_COUNT; i++) {
+        if (classes & (1u << i)) types |= 1ULL << (EV_KEY + i);
+    }
+    __atomic_store_n(&bpf.slots[SLOT_ARMED], types, __ATOMIC_SEQ_CST);
+}
+
+void kbd_bpf_consume(void) {
+    unsigned long head = __atomic_load_n(bpf.producer, __ATOMIC_ACQUIRE);
+    __atomic_store_n(bpf.consumer, head, __ATOMIC_RELEASE);
+}
+
+long long kbd_bpf_last_activity_ms(enum kbd_bpf_class cls) {
+    uint64_t ns = __atomic_load_n(&bpf.slots[EV_KEY + cls], __ATOMIC_RELAXED);
+    return ns ? (long long)(ns / 1000000) : -1;
+}
+
+void kbd_bpf_close(void) {
+    if (bpf.perf_fd >= 0) close(bpf.perf_fd);
+    if (bpf.prog_fd >= 0) close(bpf.prog_fd);
+    if (bpf.slots) munmap((void *)bpf.slots, bpf.slots_size);
+    if (bpf.consumer) munmap((void *)bpf.consumer, bpf.page_size);
+    if (bpf.producer) munmap((void *)bpf.producer, bpf.page_size);
+    if (bpf.stamps_fd >= 0) close(bpf.stamps_fd);
+    if (bpf.ringbuf_fd >= 0) close(bpf.ringbuf_fd);
+    memset(&bpf, 0, sizeof(bpf));
+    bpf.stamps_fd = bpf.ringbuf_fd = bpf.prog_fd = bpf.perf_fd = -1;
+}
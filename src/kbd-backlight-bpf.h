@@ -0,0 +1,40 @@
+/*
+ * kbd-backlight-bpf - Input activity tracking in the kernel
+ *
+ * A small BPF program on a kprobe at input_event() stamps the last event of
+ * each class into a memory-mapped array. The daemon reads the stamps when a
+ * deadline wakes it anyway, so active use costs no wakeups. Once armed, the
+ * first event posts one ring buffer record, whose fd turns readable: that is
+ * how input ends a dim. Needs root, a kernel with BPF ring buffers (5.8+)
+ * and an architecture whose kprobe argument registers we know.
+ */
+
+#ifndef KBD_BACKLIGHT_BPF_H
+#define KBD_BACKLIGHT_BPF_H
+
+/* Classes are evdev event types: keys and buttons, relative and absolute motion */
+enum kbd_bpf_class {
+    KBD_BPF_KEY,
+    KBD_BPF_REL,
+    KBD_BPF_ABS,
+    KBD_BPF_CLASS_COUNT
+};
+
+/* Load and attach; returns the fd that turns readable on armed input, -1 on failure */
+int kbd_bpf_open(int verbose);
+
+/*
+ * Post a notification on the next input event of the classes in a mask of
+ * 1 << kbd_bpf_class bits; 0 disarms. Cleared once a notification is posted.
+ */
+void kbd_bpf_arm(unsigned classes);
+
+/* Consume pending notifications so the fd stops being readable */
+void kbd_bpf_consume(void);
+
+/* CLOCK_MONOTONIC ms of the last event of a class, -1 if none yet */
+long long kbd_bpf_last_activity_ms(enum kbd_bpf_class cls);
+
+void kbd_bpf_close(void);
+
+#endif
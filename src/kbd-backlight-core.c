@@ -0,0 +1,433 @@
+/*
+ * kbd-backlight-core - Backlight policy without I/O
+ *
+ * See kbd-backlight-core.h. Everything here is plain computation on the
+ * KbdCore struct, so it can be driven by the daemon's event loop, by trace
+ * replay on a virtual clock, or embedded in another event loop.
+ */
+
+#include "kbd-backlight-core.h"
+
+#include <string.h>
+
+static void emit(KbdActions *out, enum kbd_action_type type, int level, int from, int flags) {
+    if (out->count >= KBD_MAX_ACTIONS) return;
+    KbdAction *a = &out->actions[out->count++];
+    memset(a, 0, sizeof(*a));
+    a->type = type;
+    a->level = level;
+    a->from = from;
+    a->flags = flags;
+}
+
+static void actions_begin(KbdActions *out) {
+    out->count = 0;
+    out->expired = 0;
+}
+
+static void actions_finish(const KbdCore *c, KbdActions *out) {
+    long long next = KBD_NO_DEADLINE;
+    for (int i = 0; i < KBD_DL_COUNT; i++) {
+        if (c->deadlines[i] != KBD_NO_DEADLINE && (next == KBD_NO_DEADLINE || c->deadlines[i] < next)) {
+            next = c->deadlines[i];
+        }
+    }
+    out->next_deadline_ms = next;
+    out->state = c->user_disabled ? KBD_STATE_USER_DISABLED : c->dimmed ? KBD_STATE_DIMMED : KBD_STATE_ACTIVE;
+}
+
+static int expired(const KbdCore *c, enum kbd_deadline id, long long now_ms) {
+    return c->deadlines[id] != KBD_NO_DEADLINE && c->deadlines[id] <= now_ms;
+}
+
+static long long poll_interval(const KbdCore *c) {
+    return (c->dimmed || c->user_disabled) ? KBD_POLL_INTERVAL_IDLE_MS : KBD_POLL_INTERVAL_ACTIVE_MS;
+}
+
+static long long class_timeout(const KbdCore *c, int cls) {
+    return c->cfg.class_timeout_ms[cls] > 0 ? c->cfg.class_timeout_ms[cls] : c->cfg.timeout_ms;
+}
+
+static void keep_active(KbdCore *c, long long until_ms) {
+    if (until_ms > c->active_until_ms) c->active_until_ms = until_ms;
+}
+
+/* Input arrived: it keeps the light on from its timestamps when there are any */
+static void note_activity(KbdCore *c, long long until_ms, long long now_ms) {
+    keep_active(c, until_ms != KBD_NO_DEADLINE ? until_ms : now_ms + c->cfg.timeout_ms);
+}
+
+/*
+ * Activity latch: the first input of an active period latches "user present"
+ * and input is left queued. It is watched again latch_rearm_ms before the
+ * dim deadline, which follows the class timeout of the newest input; events
+ * that queued up meanwhile mean the user is still there and the latch is
+ * renewed. Continuous use costs ~1 wakeup per timeout window. The re-arm is
+ * halfway to the deadline at the earliest, so a near dim doesn't re-arm at once.
+ */
+static long long latch_rearm_at(const KbdCore *c, long long now_ms) {
+    long long at = c->active_until_ms - c->cfg.latch_rearm_ms;
+    long long earliest = now_ms + (c->active_until_ms - now_ms + 1) / 2;
+    return at > earliest ? at : earliest;
+}
+
+static void write_level(KbdCore *c, int level, int flags, KbdActions *out) {
+    if (level < 0) level = 0;
+    if (level > c->cfg.max_brightness) level = c->cfg.max_brightness;
+    if (level == c->level) return;
+
+    emit(out, KBD_ACT_WRITE, level, c->level, flags);
+    c->level = level;
+    c->last_written = level;
+}
+
+static void watch_input(KbdCore *c, int watch, KbdActions *out) {
+    if (c->input_watched == watch) return;
+    c->input_watched = watch;
+    emit(out, KBD_ACT_WATCH_INPUT, watch, 0, 0);
+}
+
+static void fade_end(KbdCore *c, enum kbd_fade_end how, KbdActions *out) {
+    emit(out, KBD_ACT_FADE_END, c->fade.to, c->fade.from, c->fade.kernel ? KBD_ACT_KERNEL : 0);
+    out->actions[out->count - 1].how = how;
+    c->fade.active = 0;
+    c->fade.kernel = 0;
+    c->deadlines[KBD_DL_FADE] = KBD_NO_DEADLINE;
+}
+
+/* Where a kernel ramp should be by now: it interpolates linearly */
+static int kernel_fade_level(const KbdCore *c, long long now_ms) {
+    long long duration = (long long)c->cfg.fade_steps * c->cfg.fade_interval_ms;
+    long long elapsed = now_ms - c->fade.start_ms;
+    if (duration <= 0 || elapsed >= duration) return c->fade.to;
+    if (elapsed < 0) elapsed = 0;
+    return c->fade.from + (int)((c->fade.to - c->fade.from) * elapsed / duration);
+}
+
+/* Stop a kernel ramp and hold the level it had reached */
+static int kernel_fade_stop(KbdCore *c, long long now_ms, KbdActions *out) {
+    int level = kernel_fade_level(c, now_ms);
+    emit(out, KBD_ACT_KERNEL_FADE_STOP, 0, c->level, 0);
+    c->level = 0;
+    c->last_written = 0;
+    return level;
+}
+
+/* Write the fade step(s) that are due and schedule the next one */
+static void fade_tick(KbdCore *c, long long now_ms, KbdActions *out) {
+    if (!c->fade.active) return;
+
+    if (c->fade.kernel) {
+        /* Kernel ramp done: pin the exact final level */
+        write_level(c, c->fade.to, KBD_ACT_FINAL, out);
+        fade_end(c, KBD_FADE_DONE, out);
+        return;
+    }
+
+    long long due = (now_ms - c->fade.start_ms) / c->cfg.fade_interval_ms + 1;
+    if (due < c->fade.next) {
+        c->deadlines[KBD_DL_FADE] = c->fade.start_ms + (long long)(c->fade.next - 1) * c->cfg.fade_interval_ms;
+        return;
+    }
+
+    long long level = c->fade.from + due * c->fade.step;
+    if ((c->fade.step > 0 && level >= c->fade.to) || (c->fade.step < 0 && level <= c->fade.to)) {
+        write_level(c, c->fade.to, KBD_ACT_FINAL, out);
+        fade_end(c, KBD_FADE_DONE, out);
+        return;
+    }
+
+    write_level(c, (int)level, 0, out);
+    c->fade.next = (int)due + 1;
+    c->deadlines[KBD_DL_FADE] = c->fade.start_ms + due * c->cfg.fade_interval_ms;
+}
+
+static void fade_userspace(KbdCore *c, long long now_ms, KbdActions *out) {
+    int step = (c->fade.to - c->fade.from) / c->cfg.fade_steps;
+    if (step == 0) step = (c->fade.to > c->fade.from) ? 1 : -1;
+    c->fade.step = step;
+    c->fade.kernel = 0;
+    fade_tick(c, now_ms, out);
+}
+
+/*
+ * Start fading from the current level to another; replaces any fade in
+ * progress. An interrupted kernel fade continues in userspace from the
+ * level the kernel should have reached.
+ */
+static void fade_to(KbdCore *c, int to, int undim, long long now_ms, KbdActions *out) {
+    int from = c->level;
+    int interrupted = 0;
+    if (c->fade.active && c->fade.kernel) {
+        from = kernel_fade_stop(c, now_ms, out);
+        interrupted = 1;
+    }
+    if (c->fade.active) {
+        fade_end(c, KBD_FADE_INTERRUPTED, out);
+    }
+
+    if (from == to) {
+        write_level(c, to, 0, out);
+        return;
+    }
+
+    c->fade.active = 1;
+    c->fade.from = from;
+    c->fade.to = to;
+    c->fade.next = 1;
+    c->fade.undim = undim;
+    c->fade.start_ms = now_ms;
+
+    if (c->cfg.kernel_fades && !interrupted) {
+        c->fade.kernel = 1;
+        emit(out, KBD_ACT_FADE_BEGIN, to, from, (undim ? KBD_ACT_UNDIM : 0) | KBD_ACT_KERNEL);
+        emit(out, KBD_ACT_KERNEL_FADE, to, from, 0);
+        out->actions[out->count - 1].duration_ms = c->cfg.fade_steps * c->cfg.fade_interval_ms;
+        c->deadlines[KBD_DL_FADE] = now_ms + (long long)c->cfg.fade_steps * c->cfg.fade_interval_ms
+                                    + KBD_PATTERN_SETTLE_MS;
+        return;
+    }
+
+    emit(out, KBD_ACT_FADE_BEGIN, to, from, undim ? KBD_ACT_UNDIM : 0);
+    if (interrupted) {
+        write_level(c, from, 0, out);
+    }
+    fade_userspace(c, now_ms, out);
+}
+
+static void fade_cancel(KbdCore *c, long long now_ms, KbdActions *out) {
+    if (!c->fade.active) return;
+    if (c->fade.kernel) {
+        /* Keep whatever level the kernel had reached */
+        int level = kernel_fade_stop(c, now_ms, out);
+        write_level(c, level, 0, out);
+    }
+    fade_end(c, KBD_FADE_CANCELLED, out);
+}
+
+/*
+ * Compare a fresh reading with what we last wrote (e.g. the Fn+Space hotkey,
+ * which the EC handles without input events).
+ * Returns: 1 if turned on or changed externally, -1 if turned off externally, 0 otherwise.
+ */
+static int check_external_change(KbdCore *c, int actual, KbdActions *out) {
+    if (actual < 0 || !kbd_core_external_check_allowed(c)) return 0;
+    if (c->last_written < 0 || actual == c->last_written) return 0;
+    /* The driver stores levels it quantizes: we wrote 37, it reads back 36 */
+    if (c->cfg.readback && actual == c->cfg.readback[c->last_written]) return 0;
+
+    emit(out, KBD_ACT_EXTERNAL_CHANGE, actual, c->last_written, 0);
+    c->level = actual;
+    c->last_written = actual;
+    if (actual > 0) {
+        c->cfg.target_brightness = actual;
+        return 1;
+    }
+    return -1;
+}
+
+void kbd_core_init(KbdCore *c, const KbdCoreConfig *cfg, int level, long long now_ms, KbdActions *out) {
+    memset(c, 0, sizeof(*c));
+    c->cfg = *cfg;
+    if (c->cfg.fade_steps < 1) c->cfg.fade_steps = 1;
+    if (c->cfg.fade_interval_ms < 1) c->cfg.fade_interval_ms = 1;
+    for (int i = 0; i < KBD_DL_COUNT; i++) {
+        c->deadlines[i] = KBD_NO_DEADLINE;
+    }
+    c->input_watched = 1;
+    c->level = level;
+    c->last_written = -1;
+    c->active_until_ms = now_ms + c->cfg.timeout_ms;
+    for (int i = 0; i < KBD_CLASS_COUNT; i++) {
+        c->last_input_ms[i] = -1;
+    }
+    c->last_check_ms = now_ms;  /* The caller read the level to start at */
+
+    actions_begin(out);
+    write_level(c, c->cfg.target_brightness, 0, out);
+    c->deadlines[KBD_DL_DIM] = now_ms + c->cfg.timeout_ms;
+    if (c->cfg.poll_external) {
+        c->deadlines[KBD_DL_POLL] = now_ms + KBD_POLL_INTERVAL_ACTIVE_MS;
+    }
+    actions_finish(c, out);
+}
+
+void kbd_core_input_init(KbdCoreInput *in, long long now_ms) {
+    memset(in, 0, sizeof(*in));
+    in->now_ms = now_ms;
+    in->brightness = -1;
+    for (int i = 0; i < KBD_CLASS_COUNT; i++) {
+        in->activity_ms[i] = -1;
+    }
+}
+
+/* A latched core also drains when the dim is due: queued input must be seen before dimming */
+static int latch_due(const KbdCore *c, long long now_ms) {
+    return expired(c, KBD_DL_REARM, now_ms) || (c->latched && expired(c, KBD_DL_DIM, now_ms));
+}
+
+int kbd_core_drain_due(const KbdCore *c, long long now_ms) {
+    return expired(c, KBD_DL_DEBOUNCE, now_ms) || latch_due(c, now_ms);
+}
+
+int kbd_core_keepalive_due(const KbdCore *c, long long now_ms) {
+    return expired(c, KBD_DL_DIM, now_ms);
+}
+
+int kbd_core_external_check_allowed(const KbdCore *c) {
+    /* The kernel is changing the level under us during a pattern fade */
+    return !(c->fade.active && c->fade.kernel);
+}
+
+int kbd_core_external_check_due(const KbdCore *c, long long now_ms) {
+    return kbd_core_external_check_allowed(c) && now_ms - c->last_check_ms >= poll_interval(c);
+}
+
+void kbd_core_step(KbdCore *c, const KbdCoreInput *in, KbdActions *out) {
+    long long now_ms = in->now_ms;
+
+    actions_begin(out);
+    for (int i = 0; i < KBD_DL_COUNT; i++) {
+        if (expired(c, i, now_ms)) out->expired |= 1u << i;
+    }
+
+    /* External brightness changes: the user's choice wins over any fade in progress */
+    int change = check_external_change(c, in->brightness, out);
+    if (change != 0) {
+        fade_cancel(c, now_ms, out);
+    }
+    if (change == 1) {
+        /* User turned ON or changed brightness */
+        keep_active(c, now_ms + c->cfg.timeout_ms);
+        c->user_disabled = 0;
+        c->dimmed = 0;
+    } else if (change == -1) {
+        /* User turned OFF brightness - respect their choice */
+        c->user_disabled = 1;
+        c->dimmed = 0;
+    }
+
+    /*
+     * Input timestamps (evdev event times, the BPF tracker's stamps) say when
+     * the user last touched something, including input drained when a
+     * debounce ends. Each class keeps the light on for its own timeout after
+     * its newest input. Newer input of a wake class also ends a dim like a
+     * wakeup would (the BPF tracker stamps input without waking us); a
+     * keep-alive class only postpones a dim that hasn't happened yet.
+     */
+    int had_input = in->had_input;
+    long long until_ms = KBD_NO_DEADLINE;
+    for (int i = 0; i < KBD_CLASS_COUNT; i++) {
+        long long t = in->activity_ms[i];
+        if (t <= c->last_input_ms[i] || c->cfg.roles[i] == KBD_ROLE_IGNORE) continue;
+        c->last_input_ms[i] = t;
+        if (c->dimmed && c->cfg.roles[i] == KBD_ROLE_WAKE) had_input = 1;
+        if (t + class_timeout(c, i) > until_ms) until_ms = t + class_timeout(c, i);
+    }
+    if (!c->dimmed) keep_active(c, until_ms);
+
+    if (expired(c, KBD_DL_DEBOUNCE, now_ms)) {
+        /* Exit debounce: events queued meanwhile were drained, watch input again */
+        watch_input(c, 1, out);
+        c->in_debounce = 0;
+        c->deadlines[KBD_DL_DEBOUNCE] = KBD_NO_DEADLINE;
+    }
+
+    if (latch_due(c, now_ms)) {
+        if (in->drained_input) {
+            /* Input arrived while we weren't looking: user still present */
+            note_activity(c, until_ms, now_ms);
+            c->deadlines[KBD_DL_REARM] = latch_rearm_at(c, now_ms);
+        } else {
+            watch_input(c, 1, out);
+            c->latched = 0;
+            c->deadlines[KBD_DL_REARM] = KBD_NO_DEADLINE;
+        }
+    }
+
+    if (expired(c, KBD_DL_FADE, now_ms)) {
+        fade_tick(c, now_ms, out);
+    }
+
+    if (had_input) {
+        note_activity(c, until_ms, now_ms);
+
+        /*
+         * Only restore brightness if not disabled by user. If the dim fade
+         * is still running this reverses it from the current level.
+         */
+        if (c->dimmed && !c->user_disabled) {
+            fade_to(c, c->cfg.target_brightness, 1, now_ms, out);
+            c->dimmed = 0;
+        }
+
+        if (c->cfg.activity_latch) {
+            if (!c->dimmed) {
+                watch_input(c, 0, out);
+                c->latched = 1;
+                c->deadlines[KBD_DL_REARM] = latch_rearm_at(c, now_ms);
+            }
+        } else if (!c->in_debounce) {
+            /* Enter debounce: stop watching input to avoid busy-looping on it */
+            watch_input(c, 0, out);
+            c->in_debounce = 1;
+            c->deadlines[KBD_DL_DEBOUNCE] = now_ms + KBD_DEBOUNCE_MS;
+        }
+    }
+
+    /* Check for timeout (inactivity) - only if not already dimmed and not user-disabled */
+    if (!c->dimmed && !c->user_disabled && now_ms >= c->active_until_ms) {
+        if (c->latched) {
+            /* Input must be able to wake us while dimmed */
+            watch_input(c, 1, out);
+            c->latched = 0;
+            c->deadlines[KBD_DL_REARM] = KBD_NO_DEADLINE;
+        }
+        fade_to(c, c->cfg.dim_brightness, 0, now_ms, out);
+        c->dimmed = 1;
+    }
+
+    if (!c->dimmed && !c->user_disabled) {
+        c->deadlines[KBD_DL_DIM] = c->active_until_ms;
+    } else {
+        c->deadlines[KBD_DL_DIM] = KBD_NO_DEADLINE;
+    }
+
+    /*
+     * Polling strategy for external brightness changes (Fn+Space):
+     * - When active (not dimmed): check every 1s for hotkey detection
+     * - When dimmed/disabled: check every 5 seconds (user is away, less urgent)
+     * On the ChromeOS EC every reading is a host command, so input wakeups
+     * don't bring the check forward: it has its own deadline, counted from
+     * the last reading. Without change notifications the deadline is armed;
+     * with them, a wakeup that happens to come after it takes a reading to
+     * catch writes by other processes, which don't notify. A due check that
+     * could not be made (kernel fade) is put off by an interval, and at least
+     * until the ramp has settled. The interval follows the state this step
+     * left us in.
+     */
+    if (in->brightness >= 0) {
+        c->last_check_ms = now_ms;
+    }
+    if (c->cfg.poll_external) {
+        long long interval = poll_interval(c);
+        long long next = c->last_check_ms + interval;
+        if (next <= now_ms) {
+            next = now_ms + interval;
+            if (c->fade.active && c->fade.kernel && next < c->deadlines[KBD_DL_FADE]) {
+                next = c->deadlines[KBD_DL_FADE];
+            }
+        }
+        c->deadlines[KBD_DL_POLL] = next;
+    }
+
+    actions_finish(c, out);
+}
+
+void kbd_core_kernel_fade_failed(KbdCore *c, long long now_ms, KbdActions *out) {
+    actions_begin(out);
+    if (c->fade.active && c->fade.kernel) {
+        fade_userspace(c, now_ms, out);
+    }
+    actions_finish(c, out);
+}
@@ -0,0 +1,165 @@
+/*
+ * kbd-backlight-core - Backlight policy without I/O
+ *
+ * The Active / Dimmed / User-disabled state machine, input debounce and
+ * activity latch, external change handling and fade stepping. The core has
+ * no clock and performs no I/O: the caller feeds it wakeups stamped with the
+ * current time (in ms, any monotonic origin) and carries out the actions it
+ * returns, then sleeps until next_deadline_ms or the next input.
+ */
+
+#ifndef KBD_BACKLIGHT_CORE_H
+#define KBD_BACKLIGHT_CORE_H
+
+#define KBD_NO_DEADLINE -1LL
+#define KBD_DEBOUNCE_MS 200  /* Minimum interval between processing input events */
+#define KBD_POLL_INTERVAL_ACTIVE_MS 1000
+#define KBD_POLL_INTERVAL_IDLE_MS 5000
+#define KBD_PATTERN_SETTLE_MS 100  /* ledtrig-pattern updates every 50ms; let it finish */
+#define KBD_MAX_ACTIONS 16
+
+enum kbd_deadline {
+    KBD_DL_DIM,       /* Inactivity timeout */
+    KBD_DL_POLL,      /* Next external brightness check (polling mode only) */
+    KBD_DL_DEBOUNCE,  /* End of input debounce */
+    KBD_DL_REARM,     /* End of activity latch window */
+    KBD_DL_FADE,      /* Next fade step */
+    KBD_DL_COUNT
+};
+
+enum kbd_state {
+    KBD_STATE_ACTIVE,
+    KBD_STATE_DIMMED,
+    KBD_STATE_USER_DISABLED,
+    KBD_STATE_COUNT
+};
+
+/* Input device classes; each has its own role and timeout */
+enum kbd_input_class {
+    KBD_CLASS_KEYBOARD,
+    KBD_CLASS_MOUSE,
+    KBD_CLASS_TOUCHPAD,
+    KBD_CLASS_COUNT
+};
+
+enum kbd_input_role {
+    KBD_ROLE_WAKE,       /* Watched: input ends a dim */
+    KBD_ROLE_KEEPALIVE,  /* Read when the dim is due: postpones it, never ends one */
+    KBD_ROLE_IGNORE,     /* Not opened, input doesn't count */
+};
+
+enum kbd_action_type {
+    KBD_ACT_WRITE,             /* Write level */
+    KBD_ACT_KERNEL_FADE,       /* Ramp from -> level over duration_ms in the kernel */
+    KBD_ACT_KERNEL_FADE_STOP,  /* Detach the pattern trigger; the LED goes off */
+    KBD_ACT_WATCH_INPUT,       /* Watch input fds (level 1) or leave them queued (level 0) */
+    KBD_ACT_FADE_BEGIN,        /* A fade from -> level starts */
+    KBD_ACT_FADE_END,          /* The fade from -> level ended, see how */
+    KBD_ACT_EXTERNAL_CHANGE,   /* Someone else changed the level from -> level */
+};
+
+#define KBD_ACT_FINAL  0x1  /* WRITE: last write of a fade */
+#define KBD_ACT_UNDIM  0x2  /* FADE_BEGIN: brightening because of input */
+#define KBD_ACT_KERNEL 0x4  /* FADE_BEGIN/FADE_END: the ramp runs in the kernel */
+
+enum kbd_fade_end { KBD_FADE_DONE, KBD_FADE_INTERRUPTED, KBD_FADE_CANCELLED };
+
+typedef struct {
+    enum kbd_action_type type;
+    int level;
+    int from;
+    int flags;
+    int duration_ms;
+    enum kbd_fade_end how;
+} KbdAction;
+
+typedef struct {
+    KbdAction actions[KBD_MAX_ACTIONS];
+    int count;
+    unsigned expired;            /* Bit per kbd_deadline that expired in this step */
+    long long next_deadline_ms;  /* Wake up at this time, KBD_NO_DEADLINE if only input matters */
+    enum kbd_state state;
+} KbdActions;
+
+typedef struct {
+    int timeout_ms;
+    int fade_steps;
+    int fade_interval_ms;
+    int target_brightness;  /* Updated when the user picks a new level externally */
+    int dim_brightness;
+    int max_brightness;
+    int activity_latch;
+    int latch_rearm_ms;
+    int kernel_fades;       /* The caller can run fades in the kernel (KBD_ACT_KERNEL_FADE) */
+    int poll_external;      /* No change notifications: schedule polls for external changes */
+    const int *readback;    /* Level each written level reads back as (max_brightness + 1 entries), NULL if exact */
+    enum kbd_input_role roles[KBD_CLASS_COUNT];
+    int class_timeout_ms[KBD_CLASS_COUNT];  /* Timeout after input of a class, 0 = timeout_ms */
+} KbdCoreConfig;
+
+/* What a wakeup delivered */
+typedef struct {
+    long long now_ms;
+    int had_input;      /* Input arrived on a watched fd */
+    int drained_input;  /* Queued input found by a drain kbd_core_drain_due() asked for */
+    int brightness;     /* Fresh reading of the level, -1 if none (see kbd_core_external_check_due) */
+    long long activity_ms[KBD_CLASS_COUNT];  /* When the newest known input of a class happened, -1 if unknown */
+} KbdCoreInput;
+
+typedef struct {
+    KbdCoreConfig cfg;
+    int dimmed;
+    int user_disabled;
+    int in_debounce;
+    int latched;
+    int input_watched;
+    long long active_until_ms;  /* Dim deadline: newest input plus its class timeout */
+    long long last_input_ms[KBD_CLASS_COUNT];  /* Newest input time seen per class */
+    long long last_check_ms;  /* Time of the last brightness reading */
+    long long deadlines[KBD_DL_COUNT];
+    int level;          /* Level as of our last write or reading */
+    int last_written;   /* External changes are detected against this, -1 before the first write */
+    struct {
+        int active;
+        int from;
+        int to;
+        int step;
+        int next;       /* Index of the next step to write (1-based) */
+        int kernel;
+        int undim;
+        long long start_ms;
+    } fade;
+} KbdCore;
+
+/* Start in the active state at the given level; emits the write to the target level */
+void kbd_core_init(KbdCore *c, const KbdCoreConfig *cfg, int level, long long now_ms, KbdActions *out);
+
+/* A wakeup that delivered nothing yet: no input, no reading, no activity times */
+void kbd_core_input_init(KbdCoreInput *in, long long now_ms);
+
+/* Whether input queued on unwatched fds must be drained before the next step */
+int kbd_core_drain_due(const KbdCore *c, long long now_ms);
+
+/*
+ * Whether keep-alive input must be read before the next step: the dim is
+ * due, and only input of a keep-alive class can still postpone it.
+ */
+int kbd_core_keepalive_due(const KbdCore *c, long long now_ms);
+
+/* Whether a brightness reading can be compared with what was last written */
+int kbd_core_external_check_allowed(const KbdCore *c);
+
+/*
+ * Whether this wakeup should carry a brightness reading. Readings are
+ * coalesced to one per poll interval (1s active, 5s dimmed) whatever woke
+ * us; a change notification justifies a reading on its own.
+ */
+int kbd_core_external_check_due(const KbdCore *c, long long now_ms);
+
+/* Process one wakeup */
+void kbd_core_step(KbdCore *c, const KbdCoreInput *in, KbdActions *out);
+
+/* The caller could not start the kernel fade it was asked for: continue in userspace */
+void kbd_core_kernel_fade_failed(KbdCore *c, long long now_ms, KbdActions *out);
+
+#endif
@@ -14,51 +14,659 @@
 #include <signal.h>
 #include <time.h>
 #include <dirent.h>
+#include <libgen.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/inotify.h>
 #include <linux/input.h>
 
+#include "kbd-backlight-core.h"
+#include "kbd-backlight-events.h"
+#include "kbd-backlight-bpf.h"
+#include "kbd-backlight-match.h"
+
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING 1
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+#endif
+
+/*
+ * USDT probes (provider kbd_backlight) for bpftrace and perf. Each one is a
+ * single nop in the hot path until a tracer attaches; see tools/bpftrace.
+ * Without systemtap's <sys/sdt.h> they compile to nothing.
+ */
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define HAVE_USDT 1
+#include <sys/sdt.h>
+#endif
+#endif
+
+#ifdef HAVE_USDT
+#define PROBE1(name, a) DTRACE_PROBE1(kbd_backlight, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(kbd_backlight, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(kbd_backlight, name, a, b, c)
+#define PROBE4(name, a, b, c, d) DTRACE_PROBE4(kbd_backlight, name, a, b, c, d)
+#else
+#define PROBE1(name, a) do {} while (0)
+#define PROBE2(name, a, b) do {} while (0)
+#define PROBE3(name, a, b, c) do {} while (0)
+#define PROBE4(name, a, b, c, d) do {} while (0)
+#endif
+
 #define DEFAULT_BRIGHTNESS_PATH "/sys/class/leds/chromeos::kbd_backlight/brightness"
 #define DEFAULT_MAX_BRIGHTNESS_PATH "/sys/class/leds/chromeos::kbd_backlight/max_brightness"
-#define DEFAULT_TIMEOUT_SEC 5
+#define DEFAULT_TIMEOUT_MS 5000
 #define DEFAULT_FADE_STEPS 10
 #define DEFAULT_FADE_INTERVAL_MS 50
-#define MAX_INPUT_DEVICES 32
 #define INPUT_DEV_PATH "/dev/input"
+#define INPUT_SYSFS_PATH "/sys/class/input"
 #define CONFIG_PATH "/etc/kbd-backlight-daemon.conf"
-#define DEBOUNCE_MS 200  /* Minimum interval between processing input events */
+#define CALIBRATION_PATH "/var/lib/kbd-backlight-daemon/calibration"
+#define CALIBRATION_SETTLE_MS 20  /* Let the EC apply a write before reading it back */
+#define DEFAULT_LATCH_REARM_MS 1000  /* Re-arm input this long before the dim deadline */
+#define DEFAULT_TOUCHPAD_PALM_MS 2000  /* A contact without a finger-count change for longer is a resting palm */
+#define TOUCH_FLICKER_MS 50  /* A touchpad contact lifted and back within this is the same contact */
+#define MAX_EPOLL_EVENTS 32
+#define BITS_PER_LONG (8 * sizeof(unsigned long))
+#define NLONGS(n) ((n) / BITS_PER_LONG + 1)
+#define URING_ENTRIES 64
+#define URING_WRITE_SLOTS 8  /* Brightness writes that may be in flight at once */
+#define LATENCY_BUCKETS 128  /* Log-bucketed microseconds: 4 sub-buckets per power of two */
+#define INPUT_CLOCK CLOCK_MONOTONIC  /* Clock of evdev event timestamps, set with EVIOCSCLOCKID */
+#define TRACE_MAGIC "KBDTRC1\n"
+#define TRACE_RESOLUTION_US 10000  /* Records of one class and type closer than this are coalesced */
 
 typedef struct {
     char brightness_path[256];
     char max_brightness_path[256];
-    int timeout_sec;
+    char event_ring_path[256];  /* Empty: no event ring */
+    char calibration_path[256]; /* Empty: levels exact, writes instant */
+    int timeout_ms;
     int fade_steps;
     int fade_interval_ms;
     int target_brightness;
     int dim_brightness;
+    int activity_latch;   /* Stop watching input while active, re-arm near the dim deadline */
+    int latch_rearm_ms;
+    int pattern_fade;     /* Offload fades to ledtrig-pattern when available */
+    int async_writes;     /* epoll backend: brightness writes go through the writer thread */
+    int bpf_activity;     /* Track input with a BPF kprobe instead of reading evdev nodes */
+    int touchpad_contact_only;  /* Touchpads queue contact edges only, not motion frames */
+    int touchpad_palm_ms;
+    enum kbd_input_role roles[KBD_CLASS_COUNT];
+    int class_timeout_ms[KBD_CLASS_COUNT];  /* 0 = timeout_ms */
 } Config;
 
 static volatile sig_atomic_t running = 1;
+static volatile sig_atomic_t dump_metrics_requested = 0;
 static Config config;
 static int current_brightness = 0;
 static int max_brightness = 100;
-static int input_fds[MAX_INPUT_DEVICES];
-static int input_fd_count = 0;
-static int last_written_brightness = -1; /* Track what we last wrote to detect external changes */
+
+/*
+ * Everything in the epoll set is an EventSource; data.ptr points at it so
+ * the main loop can dispatch without looking fds up.
+ */
+enum source_kind {
+    SRC_INPUT,
+    SRC_TIMER,
+    SRC_HOTPLUG,
+    SRC_HW_CHANGED,
+    SRC_BRIGHTNESS_READ,   /* io_uring completions only */
+    SRC_BRIGHTNESS_WRITE,
+    SRC_WRITER_DONE,       /* Writer thread finished a write we asked to hear about */
+    SRC_ACTIVITY           /* BPF ring buffer: input after a dim */
+};
+
+typedef struct {
+    enum source_kind kind;
+    int fd;
+} EventSource;
+
+/* Capability bitmaps of an evdev device, as reported by EVIOCGBIT or sysfs */
+typedef struct {
+    unsigned long ev[NLONGS(EV_CNT)];
+    unsigned long key[NLONGS(KEY_CNT)];
+    unsigned long rel[NLONGS(REL_CNT)];
+    unsigned long abs[NLONGS(ABS_CNT)];
+} DeviceCaps;
+
+/*
+ * Contact tracking for touchpads in contact-only mode. A contact counts as
+ * activity from touch-down until touchpad_palm_ms after its last edge
+ * (touch-down, finger-count change, button); longer than that with no edge,
+ * it is a resting palm and neither it nor its release counts.
+ */
+typedef struct {
+    int enabled;
+    int down;             /* A contact is in progress */
+    long long edge_us;    /* Last edge that counted */
+    long long touch_us;   /* Last BTN_TOUCH edge, counted or not */
+    long long up_us;      /* Last release, -1 if none */
+} TouchContact;
+
+typedef struct {
+    EventSource src;      /* Must be first: epoll data.ptr points here */
+    char node[32];        /* Node name under INPUT_DEV_PATH, e.g. "event4" */
+    enum kbd_input_class cls;
+    unsigned long long bytes_drained;
+    unsigned long long events_drained;
+    int stamped;          /* Event timestamps are on INPUT_CLOCK */
+    TouchContact contact;
+    int inflight;         /* io_uring: a read into buf is posted */
+    int dead;             /* io_uring: removed, freed once the posted read completes */
+    struct input_event buf[64];
+} InputDevice;
+
+/* Device records are allocated individually so epoll pointers stay valid when the table grows */
+static InputDevice **input_devices = NULL;
+static int input_device_count = 0;
+static int input_device_capacity = 0;
+static int input_monitoring = 1;  /* Input fds of wake classes are currently in the epoll set */
+static int recording = 0;  /* --record: every class is watched, roles are applied on replay */
 static int epoll_fd = -1;
-static int brightness_fd = -1;  /* Persistent fd for reading brightness */
+static int brightness_fd = -1;  /* Persistent fd for reading and writing brightness */
+static int verbose = 0;
+static const char *config_path = CONFIG_PATH;
+static EventSource timer_source = { SRC_TIMER, -1 };
+static EventSource hotplug_source = { SRC_HOTPLUG, -1 };        /* inotify on INPUT_DEV_PATH */
+static EventSource hw_changed_source = { SRC_HW_CHANGED, -1 };  /* brightness_hw_changed, if present */
+static EventSource activity_source = { SRC_ACTIVITY, -1 };      /* BPF tracker's ring buffer, if in use */
+static int activity_armed = 0;  /* The BPF tracker posts on the next input */
+static char led_dir[256];       /* LED class directory holding brightness_path */
+static int pattern_supported = 0;      /* ledtrig-pattern is available for this LED */
+static int pattern_trigger_active = 0; /* "pattern" is the LED's current trigger */
+static int use_uring = 0;              /* Event loop backend: io_uring instead of epoll */
+
+/*
+ * Activity traces hold input timing only: device class, event type and
+ * time, never key codes. After TRACE_MAGIC, each record is a LEB128 varint
+ * of microseconds since the previous record followed by one byte,
+ * (class << 4) | event type. A record with type 0 marks the end of the
+ * recording. Replay feeds the trace to the policy core on a virtual clock.
+ */
+enum trace_class { TC_OTHER, TC_KEYBOARD, TC_MOUSE, TC_TOUCHPAD, TC_COUNT };
+
+typedef struct {
+    FILE *f;
+    long long prev_us;                       /* Time of the previous record */
+    long long last_us[TC_COUNT][EV_ABS + 1]; /* Last record per class and type (recording) */
+    unsigned long records;
+    long long next_us;                       /* Next unconsumed record (replay), -1 when done */
+    int next_class;                          /* ... and its trace_class */
+    long long end_us;                        /* End of the recording (replay) */
+    long long keepalive_us[KBD_CLASS_COUNT]; /* Newest keep-alive input not yet seen by the core (replay) */
+} Trace;
+
+static Trace trace = { .next_us = -1, .end_us = -1 };
+static double replay_speed = 0;     /* Pace replay at this multiple of real time, 0 = unpaced */
+
+/*
+ * Policy core (state machine, debounce/latch, fades). Its timed events are
+ * absolute CLOCK_MONOTONIC deadlines; a single timerfd in the epoll set is
+ * armed for the earliest one, so the loop sleeps until the next real
+ * deadline and no longer.
+ */
+static KbdCore core;
+static long long armed_deadline = KBD_NO_DEADLINE;
+
+static const char *const input_class_names[KBD_CLASS_COUNT] = { "keyboard", "mouse", "touchpad" };
+static const char *const role_names[] = { "wake", "keepalive", "ignore" };
+
+/* Fixed-size log-bucketed latency histogram, in microseconds */
+typedef struct {
+    unsigned long count;
+    unsigned long long max_us;
+    unsigned long buckets[LATENCY_BUCKETS];
+} LatencyHistogram;
+
+/*
+ * Runtime metrics: plain counters bumped on the hot paths (no atomics, no
+ * syscalls), dumped to stderr on SIGUSR1 and at exit.
+ */
+typedef struct {
+    unsigned long wakeups;
+    unsigned long wakeups_input;
+    unsigned long wakeups_timer;
+    unsigned long wakeups_hw_changed;
+    unsigned long wakeups_hotplug;
+    unsigned long wakeups_other;        /* io_uring brightness I/O and cancel completions */
+    unsigned long deadline_hits[KBD_DL_COUNT];
+    unsigned long sysfs_reads;
+    unsigned long sysfs_reads_saved;    /* Wakeups that used to read the level but had no check due */
+    unsigned long keepalive_checks;     /* Dim deadlines that read the keep-alive devices first */
+    unsigned long keepalive_postponed;  /* ... and stayed on */
+    unsigned long touch_contacts;       /* Contact-only touchpads: contacts that counted */
+    unsigned long touch_flicker;        /* ... releases merged into the next touch-down */
+    unsigned long touch_palms;          /* ... contacts ignored as a resting palm */
+    unsigned long sysfs_writes;
+    unsigned long sysfs_syscalls;       /* Syscalls issued on the LED's sysfs attributes */
+    unsigned long fades_started;
+    unsigned long fades_kernel;
+    unsigned long fades_completed;
+    unsigned long fades_aborted;
+    unsigned long long removed_bytes_drained;   /* Drain totals of devices since unplugged */
+    unsigned long long removed_events_drained;
+    LatencyHistogram latency_first;     /* Input event that ended a dim -> first brightness write */
+    LatencyHistogram latency_full;      /* ... -> final write of the brightening fade */
+    long long state_ms[KBD_STATE_COUNT];
+    enum kbd_state state;
+    long long state_since_ms;
+    long long start_ms;
+} Metrics;
+
+static Metrics metrics;
+
+/*
+ * Input-to-light latency probe. A fade the core starts because input ended
+ * a dim takes the timestamp of the first event of that wakeup, and
+ * brightness writes landing for that fade record the samples.
+ */
+typedef struct {
+    long long input_us;   /* Input timestamp of the fade being measured */
+    int active;
+    int first_done;
+    int final_queued;     /* The fade's last write has been issued */
+} LatencyProbe;
+
+static LatencyProbe latency;
+static long long wake_input_us = -1;  /* Timestamp of the first event read this wakeup */
+static long long newest_input_us[KBD_CLASS_COUNT];  /* ... and of the newest per class, for the core */
+
+static unsigned long fade_syscalls_at_start;  /* For the verbose per-fade syscall count */
+static int fade_running = 0;                   /* Between the core's FADE_BEGIN and FADE_END */
 
 static void signal_handler(int sig) {
-    (void)sig;
+    if (sig == SIGUSR1) {
+        dump_metrics_requested = 1;
+        return;
+    }
     running = 0;
 }
 
+static long long monotonic_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Shared-memory event ring (see kbd-backlight-events.h), NULL if disabled,
+ * not writable or in use. Appending costs a vDSO clock read and a few stores.
+ */
+static KbdEventRing *event_ring = NULL;
+static int event_ring_fd = -1;  /* Holds the ring's lock while we run */
+
+static void event_log(enum kbd_event_type type, int a, int b, int c) {
+    if (!event_ring) return;
+
+    uint64_t seq = event_ring->head;
+    KbdEventRecord *r = &event_ring->records[seq & (KBD_EVENTS_CAPACITY - 1)];
+    __atomic_store_n(&r->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    r->time_us = monotonic_us();
+    r->type = type;
+    r->a = a;
+    r->b = b;
+    r->c = c;
+    __atomic_store_n(&r->seq, seq + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&event_ring->head, seq + 1, __ATOMIC_RELEASE);
+}
+
+/* Map the event ring, continuing the history of a previous run if it is compatible */
+static void event_ring_open(void) {
+    const char *path = config.event_ring_path;
+    if (!path[0]) return;
+
+    char dir[sizeof(config.event_ring_path)];
+    strncpy(dir, path, sizeof(dir));
+    if (mkdir(dirname(dir), 0755) < 0 && errno != EEXIST) {
+        fprintf(stderr, "Event ring disabled: %s: %s\n", dir, strerror(errno));
+        return;
+    }
+
+    /* Input timing is private: root only */
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        fprintf(stderr, "Event ring disabled: %s: %s\n", path, strerror(errno));
+        return;
+    }
+    /* Appends take no locks: a second writer would interleave records with ours */
+    if (flock(fd, LOCK_EX | LOCK_NB) < 0) {
+        fprintf(stderr, "Warning: event ring disabled: %s: %s\n", path,
+                errno == EWOULDBLOCK ? "in use by another daemon" : strerror(errno));
+        close(fd);
+        return;
+    }
+    if (ftruncate(fd, sizeof(KbdEventRing)) < 0) {
+        fprintf(stderr, "Event ring disabled: %s: %s\n", path, strerror(errno));
+        close(fd);
+        return;
+    }
+
+    void *map = mmap(NULL, sizeof(KbdEventRing), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Event ring disabled: mmap: %s\n", strerror(errno));
+        close(fd);
+        return;
+    }
+    event_ring_fd = fd;  /* The lock lasts as long as the fd, and follows it across daemonize() */
+
+    KbdEventRing *ring_map = map;
+    if (ring_map->magic != KBD_EVENTS_MAGIC || ring_map->version != KBD_EVENTS_VERSION ||
+        ring_map->capacity != KBD_EVENTS_CAPACITY || ring_map->record_size != sizeof(KbdEventRecord)) {
+        memset(ring_map, 0, sizeof(*ring_map));
+        ring_map->version = KBD_EVENTS_VERSION;
+        ring_map->capacity = KBD_EVENTS_CAPACITY;
+        ring_map->record_size = sizeof(KbdEventRecord);
+        __atomic_store_n(&ring_map->magic, KBD_EVENTS_MAGIC, __ATOMIC_RELEASE);
+    }
+    event_ring = ring_map;
+}
+
 static long long get_time_ms(void) {
     struct timespec ts;
     clock_gettime(CLOCK_MONOTONIC, &ts);
     return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
+static long long input_clock_us(void) {
+    struct timespec ts;
+    clock_gettime(INPUT_CLOCK, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* When an event happened: its kernel timestamp, or now if the device couldn't switch clocks */
+static long long input_event_us(const InputDevice *dev, const struct input_event *ev) {
+    if (!dev->stamped) return input_clock_us();
+    return (long long)ev->input_event_sec * 1000000 + ev->input_event_usec;
+}
+
+/* Follow contacts through the edges of a read; returns the newest edge that counts, -1 if none */
+static long long contact_events(InputDevice *dev, const struct input_event *evs, size_t count) {
+    TouchContact *tc = &dev->contact;
+    long long palm_us = config.touchpad_palm_ms * 1000LL;
+    long long newest = -1;
+    for (size_t i = 0; i < count; i++) {
+        if (evs[i].type != EV_KEY) continue;
+        long long t = input_event_us(dev, &evs[i]);
+        switch (evs[i].code) {
+        case BTN_TOUCH:
+            tc->touch_us = t;
+            if (evs[i].value && !tc->down) {
+                tc->down = 1;
+                if (tc->up_us >= 0 && t - tc->up_us < TOUCH_FLICKER_MS * 1000LL) {
+                    /* Sensor flicker: the contact goes on, and so does its palm clock */
+                    metrics.touch_flicker++;
+                    continue;
+                }
+                tc->edge_us = t;
+                metrics.touch_contacts++;
+            } else if (!evs[i].value && tc->down) {
+                tc->down = 0;
+                tc->up_us = t;
+                if (t - tc->edge_us > palm_us) {
+                    metrics.touch_palms++;
+                    continue;
+                }
+            } else {
+                continue;
+            }
+            break;
+        case BTN_TOOL_DOUBLETAP:
+        case BTN_TOOL_TRIPLETAP:
+        case BTN_TOOL_QUADTAP:
+        case BTN_TOOL_QUINTTAP:
+            /*
+             * Fingers added or lifted mid-contact. input-mt reports BTN_TOUCH
+             * before the finger count, so a count in a touch edge's frame
+             * (same timestamp) belongs to that edge.
+             */
+            if (!tc->down || t == tc->touch_us) continue;
+            tc->edge_us = t;
+            break;
+        default:
+            /* Physical buttons */
+            if (!evs[i].value) continue;
+            if (tc->down) tc->edge_us = t;
+            break;
+        }
+        newest = t;
+    }
+    return newest;
+}
+
+/*
+ * Note the first and newest event times of a read of count events. Returns
+ * 1 if the read counts as input (a contact-only touchpad may have read only
+ * flicker or a palm).
+ */
+static int input_events_seen(InputDevice *dev, const struct input_event *evs, size_t count) {
+    if (count == 0) return 0;
+    long long first, last;
+    if (dev->contact.enabled) {
+        first = last = contact_events(dev, evs, count);
+        if (last < 0) return 0;
+    } else {
+        first = input_event_us(dev, &evs[0]);
+        last = input_event_us(dev, &evs[count - 1]);
+    }
+    if (wake_input_us < 0) wake_input_us = first;
+    if (last > newest_input_us[dev->cls]) newest_input_us[dev->cls] = last;
+    return 1;
+}
+
+static int latency_bucket(unsigned long long us) {
+    if (us < 4) return (int)us;
+    int msb = 63 - __builtin_clzll(us);
+    int idx = (msb - 1) * 4 + (int)((us >> (msb - 2)) & 3);
+    return idx < LATENCY_BUCKETS ? idx : LATENCY_BUCKETS - 1;
+}
+
+/* Smallest value that falls into bucket idx */
+static unsigned long long latency_bucket_floor(int idx) {
+    if (idx < 4) return (unsigned long long)idx;
+    int msb = idx / 4 + 1;
+    return (unsigned long long)(4 + idx % 4) << (msb - 2);
+}
+
+static void latency_record(LatencyHistogram *h, long long us) {
+    if (us < 0) us = 0;
+    h->buckets[latency_bucket((unsigned long long)us)]++;
+    h->count++;
+    if ((unsigned long long)us > h->max_us) h->max_us = (unsigned long long)us;
+}
+
+/* Upper bound of the bucket holding the given percentile, capped at the max */
+static unsigned long long latency_percentile(const LatencyHistogram *h, double pct) {
+    unsigned long rank = (unsigned long)(h->count * pct / 100.0 + 0.999999);
+    unsigned long seen = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= rank && seen > 0) {
+            unsigned long long upper = i + 1 < LATENCY_BUCKETS ? latency_bucket_floor(i + 1) - 1 : h->max_us;
+            return upper < h->max_us ? upper : h->max_us;
+        }
+    }
+    return h->max_us;
+}
+
+/* A brightness write of the measured fade has landed */
+static void latency_write_completed(int writes_pending) {
+    if (!latency.active) return;
+
+    long long latency_us = input_clock_us() - latency.input_us;
+    if (!latency.first_done) {
+        latency_record(&metrics.latency_first, latency_us);
+        latency.first_done = 1;
+    }
+    if (latency.final_queued && !writes_pending) {
+        latency_record(&metrics.latency_full, latency_us);
+        latency.active = 0;
+    }
+}
+
+static int epoll_watch(EventSource *src, uint32_t events) {
+    /* With io_uring the source's read is posted from the wait loop instead */
+    if (use_uring) return 0;
+
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = src;
+    return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, src->fd, &ev);
+}
+
+static int setup_timer(void) {
+    timer_source.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer_source.fd < 0) {
+        fprintf(stderr, "Failed to create timerfd: %s\n", strerror(errno));
+        return -1;
+    }
+
+    if (epoll_watch(&timer_source, EPOLLIN) < 0) {
+        fprintf(stderr, "Failed to add timerfd to epoll: %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/* Program the timerfd for the core's next deadline (no-op if unchanged) */
+static void deadline_arm(long long next) {
+    if (next == armed_deadline) return;
+
+    /* An all-zero it_value disarms the timer */
+    struct itimerspec its = {0};
+    if (next != KBD_NO_DEADLINE) {
+        its.it_value.tv_sec = next / 1000;
+        its.it_value.tv_nsec = (next % 1000) * 1000000L;
+    }
+    if (timerfd_settime(timer_source.fd, TFD_TIMER_ABSTIME, &its, NULL) == 0) {
+        armed_deadline = next;
+    }
+}
+
+#ifdef HAVE_IO_URING
+/*
+ * Minimal io_uring plumbing on raw syscalls (no liburing dependency).
+ * Every source keeps one read (or poll) posted with its EventSource as
+ * user_data; re-posts and brightness reads/writes are queued as SQEs and go
+ * out with the io_uring_enter that also waits, so a wakeup is one syscall.
+ */
+typedef struct {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned sq_entries;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned to_submit;
+} Ring;
+
+static Ring ring = { .fd = -1 };
+
+static int uring_setup(void) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    ring.fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (ring.fd < 0) return -1;
+
+    size_t sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (cq_len > sq_len) sq_len = cq_len;
+    }
+
+    char *sq = mmap(NULL, sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    ring.fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED) goto fail;
+
+    char *cq = sq;
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        cq = mmap(NULL, cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                  ring.fd, IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED) goto fail;
+    }
+
+    ring.sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+    if (ring.sqes == MAP_FAILED) goto fail;
+
+    ring.sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring.sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring.sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring.sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring.sq_entries = params.sq_entries;
+    ring.cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring.cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring.cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    return 0;
+
+fail:
+    /* Mappings go away with the process; the ring fd is what matters */
+    close(ring.fd);
+    ring.fd = -1;
+    return -1;
+}
+
+static int uring_enter(unsigned wait_nr) {
+    int ret = (int)syscall(__NR_io_uring_enter, ring.fd, ring.to_submit, wait_nr,
+                           wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (ret >= 0) {
+        ring.to_submit -= (unsigned)ret < ring.to_submit ? (unsigned)ret : ring.to_submit;
+    }
+    return ret;
+}
+
+static struct io_uring_sqe *uring_get_sqe(void) {
+    unsigned tail = *ring.sq_tail;
+    if (tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE) >= ring.sq_entries) {
+        /* SQ full: push what we have without waiting */
+        uring_enter(0);
+        if (tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE) >= ring.sq_entries) return NULL;
+    }
+
+    unsigned idx = tail & *ring.sq_mask;
+    struct io_uring_sqe *sqe = &ring.sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    ring.sq_array[idx] = idx;
+    __atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring.to_submit++;
+    return sqe;
+}
+
+static struct io_uring_sqe *uring_prep(int op, int fd, void *addr, unsigned len, void *user_data) {
+    struct io_uring_sqe *sqe = uring_get_sqe();
+    if (!sqe) return NULL;
+    sqe->opcode = (uint8_t)op;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)addr;
+    sqe->len = len;
+    sqe->user_data = (uintptr_t)user_data;
+    return sqe;
+}
+
+static EventSource brightness_write_source = { SRC_BRIGHTNESS_WRITE, -1 };
+static char uring_write_bufs[URING_WRITE_SLOTS][16];
+static unsigned uring_write_seq = 0;
+static int uring_writes_inflight = 0;
+static int uring_read_inflight = 0;
+static int uring_read_stale = 0;  /* A write was queued after the pending read */
+#endif
+
 static int read_int_from_file(const char *path) {
     FILE *f = fopen(path, "r");
     if (!f) return -1;
@@ -72,288 +680,1975 @@ static int read_int_from_file(const char *path) {
     return value;
 }
 
-/* Fast brightness read using persistent fd - avoids open/close overhead */
+/* Fast brightness read using persistent fd - a single pread, no open/close */
 static int read_brightness_fast(void) {
     if (brightness_fd < 0) return -1;
 
     char buf[16];
-    if (lseek(brightness_fd, 0, SEEK_SET) < 0) return -1;
-
-    ssize_t n = read(brightness_fd, buf, sizeof(buf) - 1);
+    metrics.sysfs_reads++;
+    metrics.sysfs_syscalls++;
+    ssize_t n = pread(brightness_fd, buf, sizeof(buf) - 1, 0);
     if (n <= 0) return -1;
 
     buf[n] = '\0';
     return atoi(buf);
 }
 
-static int write_int_to_file(const char *path, int value) {
-    FILE *f = fopen(path, "w");
-    if (!f) return -1;
-
-    fprintf(f, "%d", value);
-    fclose(f);
-    return 0;
-}
+/*
+ * Format a non-negative level as decimal followed by '\n', without stdio.
+ * The newline keeps plain files (test backlights) readable when a shorter
+ * number overwrites a longer one; sysfs ignores it.
+ */
+static int format_level(char *buf, int value) {
+    char digits[12];
+    int n = 0;
+    do {
+        digits[n++] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value > 0);
+
+    int len = 0;
+    while (n > 0) {
+        buf[len++] = digits[--n];
+    }
+    buf[len++] = '\n';
+    return len;
+}
+
+/* Write a level through the persistent fd: one pwrite from a stack buffer */
+static int write_brightness_fast(int value) {
+    if (brightness_fd < 0) return -1;
+
+#ifdef HAVE_IO_URING
+    if (use_uring && uring_writes_inflight < URING_WRITE_SLOTS) {
+        /* Queued as an SQE; goes out with the next io_uring_enter */
+        char *slot = uring_write_bufs[uring_write_seq++ % URING_WRITE_SLOTS];
+        int slot_len = format_level(slot, value);
+        if (uring_prep(IORING_OP_WRITE, brightness_fd, slot, slot_len, &brightness_write_source)) {
+            metrics.sysfs_writes++;
+            uring_writes_inflight++;
+            if (uring_read_inflight) uring_read_stale = 1;
+            return 0;
+        }
+    }
+#endif
+
+    char buf[16];
+    int len = format_level(buf, value);
+    metrics.sysfs_writes++;
+    metrics.sysfs_syscalls++;
+    return pwrite(brightness_fd, buf, len, 0) == len ? 0 : -1;
+}
+
+/*
+ * Brightness writer thread (epoll backend). A write to the EC-backed LED can
+ * take milliseconds, so the event loop only posts the level into a one-slot
+ * mailbox and the thread writes it. Posting over a level the thread hasn't
+ * picked up yet replaces it: a slow EC gets the newest fade step rather than
+ * a backlog of stale ones. The slot holds (post sequence << 32) | level, and
+ * the thread publishes the sequence of the last write it finished, so the
+ * loop knows whether a write is outstanding without locks.
+ */
+#define WRITER_EMPTY (~0ULL)
+#define WRITER_STOP (~0ULL - 1)
+
+typedef struct {
+    pthread_t thread;
+    int running;
+    int wake_fd;                 /* eventfd: a level was posted into an empty mailbox */
+    EventSource done;            /* eventfd: a write finished while notify was set */
+    uint64_t mailbox;
+    uint32_t posted_seq;         /* Loop only */
+    uint32_t done_seq;           /* Written by the thread */
+    int notify;                  /* Loop wants the done eventfd signalled after the next write */
+    unsigned long superseded;    /* Loop only: levels replaced before the thread took them */
+    unsigned long writes;        /* The thread's counters */
+    unsigned long failed;
+} Writer;
+
+static Writer writer = { .wake_fd = -1, .done = { SRC_WRITER_DONE, -1 }, .mailbox = WRITER_EMPTY };
+
+static void *writer_main(void *arg) {
+    (void)arg;
+    for (;;) {
+        uint64_t n;
+        if (read(writer.wake_fd, &n, sizeof(n)) < 0 && errno != EINTR) break;
+
+        uint64_t slot = __atomic_exchange_n(&writer.mailbox, WRITER_EMPTY, __ATOMIC_ACQUIRE);
+        if (slot == WRITER_EMPTY) continue;
+        if (slot == WRITER_STOP) break;
+
+        char buf[16];
+        int len = format_level(buf, (int)(slot & 0xffffffff));
+        int ok = pwrite(brightness_fd, buf, len, 0) == len;
+        __atomic_add_fetch(&writer.writes, 1, __ATOMIC_RELAXED);
+        if (!ok) {
+            __atomic_add_fetch(&writer.failed, 1, __ATOMIC_RELAXED);
+            if (verbose) fprintf(stderr, "Brightness write failed: %s\n", strerror(errno));
+        }
+        __atomic_store_n(&writer.done_seq, (uint32_t)(slot >> 32), __ATOMIC_SEQ_CST);
+        if (__atomic_exchange_n(&writer.notify, 0, __ATOMIC_SEQ_CST)) {
+            uint64_t one = 1;
+            if (write(writer.done.fd, &one, sizeof(one)) < 0) {}
+        }
+    }
+    return NULL;
+}
+
+/* A posted level hasn't been written yet (a read now could see the old one) */
+static int writer_busy(void) {
+    return writer.running && __atomic_load_n(&writer.done_seq, __ATOMIC_SEQ_CST) != writer.posted_seq;
+}
+
+/* Signal writer.done after the thread's next write */
+static void writer_want_notify(void) {
+    __atomic_store_n(&writer.notify, 1, __ATOMIC_SEQ_CST);
+}
+
+static void writer_post(uint64_t slot) {
+    uint64_t prev = __atomic_exchange_n(&writer.mailbox, slot, __ATOMIC_RELEASE);
+    if (prev != WRITER_EMPTY) {
+        /* The thread hasn't taken the previous level yet and will find this one instead */
+        writer.superseded++;
+        return;
+    }
+    uint64_t one = 1;
+    if (write(writer.wake_fd, &one, sizeof(one)) < 0) {}
+}
+
+/* Wait for outstanding writes, e.g. before switching triggers under them */
+static void writer_flush(void) {
+    while (writer_busy()) {
+        writer_want_notify();
+        if (!writer_busy()) break;
+        struct pollfd pfd = { .fd = writer.done.fd, .events = POLLIN };
+        uint64_t n;
+        if (poll(&pfd, 1, 100) > 0 && read(writer.done.fd, &n, sizeof(n)) < 0) {}
+    }
+}
+
+static int writer_start(void) {
+    writer.wake_fd = eventfd(0, EFD_CLOEXEC);
+    writer.done.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (writer.wake_fd < 0 || writer.done.fd < 0 || epoll_watch(&writer.done, EPOLLIN) < 0) {
+        fprintf(stderr, "Failed to set up the writer thread: %s\n", strerror(errno));
+        return -1;
+    }
+
+    /* Signals must reach the event loop, not the writer */
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    int ret = pthread_create(&writer.thread, NULL, writer_main, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (ret != 0) {
+        fprintf(stderr, "Failed to start the writer thread: %s\n", strerror(ret));
+        return -1;
+    }
+    writer.running = 1;
+    return 0;
+}
+
+/* Let outstanding writes land and join the thread; later writes are synchronous */
+static void writer_stop(void) {
+    if (!writer.running) return;
+    writer_flush();
+    writer_post(WRITER_STOP);
+    pthread_join(writer.thread, NULL);
+    writer.running = 0;
+}
+
+/*
+ * Write a level (clamped), through the writer thread or io_uring when in use.
+ * The set_brightness_return probe reports 1 written (or queued), 0 unchanged, -1 failed.
+ */
+static void set_brightness(int brightness) {
+    if (brightness < 0) brightness = 0;
+    if (brightness > max_brightness) brightness = max_brightness;
+    PROBE1(set_brightness_entry, brightness);
+
+    if (brightness == current_brightness) {
+        PROBE2(set_brightness_return, brightness, 0);
+        return;
+    }
+    if (writer.running) {
+        writer_post(((uint64_t)++writer.posted_seq << 32) | (uint32_t)brightness);
+    } else if (write_brightness_fast(brightness) < 0) {
+        PROBE2(set_brightness_return, brightness, -1);
+        event_log(KBD_EVENT_WRITE, brightness, -1, 0);
+        return;
+    }
+
+    current_brightness = brightness;
+    if (brightness == 0) {
+        /* Writing 0 to brightness detaches any trigger */
+        pattern_trigger_active = 0;
+    }
+    PROBE2(set_brightness_return, brightness, 1);
+    event_log(KBD_EVENT_WRITE, brightness, 1, 0);
+#ifdef HAVE_IO_URING
+    /* Queued writes are accounted when their completion arrives */
+    if (use_uring && uring_writes_inflight > 0) return;
+#endif
+    if (writer.running) {
+        /* ... or when the writer thread reports it */
+        if (latency.active) writer_want_notify();
+        return;
+    }
+    latency_write_completed(0);
+}
+
+static int write_str_to_led_attr(const char *attr, const char *str) {
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%s", led_dir, attr);
+
+    metrics.sysfs_syscalls++;
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+
+    size_t len = strlen(str);
+    metrics.sysfs_writes++;
+    metrics.sysfs_syscalls += 2;
+    int ret = write(fd, str, len) == (ssize_t)len ? 0 : -1;
+    close(fd);
+    return ret;
+}
+
+/*
+ * Check the LED's trigger list for ledtrig-pattern. The list looks like
+ * "[none] kbd-backlight pattern ...", with the active trigger in brackets.
+ */
+static int detect_pattern_trigger(void) {
+    char path[512];
+    snprintf(path, sizeof(path), "%s/trigger", led_dir);
+
+    FILE *f = fopen(path, "r");
+    if (!f) return 0;
+
+    char name[64];
+    int found = 0;
+    while (fscanf(f, "%63s", name) == 1) {
+        if (strcmp(name, "pattern") == 0) {
+            found = 1;
+        } else if (strcmp(name, "[pattern]") == 0) {
+            found = 1;
+            pattern_trigger_active = 1;
+        }
+    }
+    fclose(f);
+    return found;
+}
+
+/* Detach the pattern trigger; the LED core turns the LED off when doing so */
+static void pattern_trigger_stop(void) {
+    if (!pattern_trigger_active) return;
+    writer_flush();
+    write_str_to_led_attr("trigger", "none");
+    pattern_trigger_active = 0;
+    current_brightness = 0;
+}
+
+/*
+ * Hand the whole ramp to the kernel: one "from duration to 0" pattern played
+ * once. The kernel interpolates on its own timer; we only come back at the
+ * end to write the exact final level.
+ */
+static int pattern_fade_start(int from, int to, int duration_ms) {
+    /* A brightness write landing after the pattern would cut it short */
+    writer_flush();
+    if (!pattern_trigger_active) {
+        if (write_str_to_led_attr("trigger", "pattern") < 0) return -1;
+        pattern_trigger_active = 1;
+    }
+
+    char pattern[64];
+    snprintf(pattern, sizeof(pattern), "%d %d %d 0", from, duration_ms, to);
+    /* A new pattern only plays after repeat is (re)set, so write it last */
+    if (write_str_to_led_attr("pattern", pattern) < 0 ||
+        write_str_to_led_attr("repeat", "1") < 0) {
+        pattern_trigger_stop();
+        return -1;
+    }
+    return 0;
+}
+
+static int test_bit_in(const unsigned long *bits, int bit) {
+    return (bits[bit / BITS_PER_LONG] >> (bit % BITS_PER_LONG)) & 1;
+}
+
+/*
+ * Parse one capability bitmap from /sys/class/input/<node>/device/capabilities.
+ * The kernel prints it as space-separated hex longs, most significant first.
+ */
+static int read_sysfs_caps(const char *node, const char *cap, unsigned long *bits, size_t nlongs) {
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%s/device/capabilities/%s", INPUT_SYSFS_PATH, node, cap);
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+
+    char buf[1024];
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0) return -1;
+    buf[n] = '\0';
+
+    char *words[64];
+    size_t count = 0;
+    for (char *tok = strtok(buf, " \n"); tok && count < 64; tok = strtok(NULL, " \n")) {
+        words[count++] = tok;
+    }
+
+    memset(bits, 0, nlongs * sizeof(*bits));
+    for (size_t i = 0; i < count && i < nlongs; i++) {
+        bits[i] = strtoul(words[count - 1 - i], NULL, 16);
+    }
+    return 0;
+}
+
+/* Read /sys/class/input/<node>/device/<attr>, without the trailing newline */
+static int read_sysfs_attr(const char *node, const char *attr, char *buf, size_t size) {
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%s/device/%s", INPUT_SYSFS_PATH, node, attr);
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    ssize_t n = read(fd, buf, size - 1);
+    close(fd);
+    if (n < 0) return -1;
+    buf[n] = '\0';
+    buf[strcspn(buf, "\n")] = '\0';
+    return 0;
+}
+
+/* Name, phys and id from sysfs, as EVIOCGNAME/EVIOCGPHYS/EVIOCGID report them */
+static int read_device_ident_sysfs(const char *node, KbdDeviceIdent *ident) {
+    char buf[16];
+    memset(ident, 0, sizeof(*ident));
+    if (read_sysfs_attr(node, "name", ident->name, sizeof(ident->name)) < 0) return -1;
+    read_sysfs_attr(node, "phys", ident->phys, sizeof(ident->phys));
+    if (read_sysfs_attr(node, "id/vendor", buf, sizeof(buf)) == 0) ident->vendor = strtoul(buf, NULL, 16);
+    if (read_sysfs_attr(node, "id/product", buf, sizeof(buf)) == 0) ident->product = strtoul(buf, NULL, 16);
+    return 0;
+}
+
+static void read_device_ident_ioctl(int fd, KbdDeviceIdent *ident) {
+    struct input_id id;
+    memset(ident, 0, sizeof(*ident));
+    if (ioctl(fd, EVIOCGNAME(sizeof(ident->name) - 1), ident->name) < 0) ident->name[0] = '\0';
+    if (ioctl(fd, EVIOCGPHYS(sizeof(ident->phys) - 1), ident->phys) < 0) ident->phys[0] = '\0';
+    if (ioctl(fd, EVIOCGID, &id) == 0) {
+        ident->vendor = id.vendor;
+        ident->product = id.product;
+    }
+}
+
+/* Whether the allow/deny rules let us open a device: denied never, unnamed only without allow rules */
+static int device_allowed(const KbdDeviceIdent *ident) {
+    enum kbd_match_verdict verdict = kbd_match_device(ident);
+    return verdict == KBD_MATCH_ALLOW || (verdict == KBD_MATCH_NONE && kbd_match_allow_count() == 0);
+}
+
+/* Read capabilities from sysfs - doesn't touch (or runtime-resume) the device */
+static int read_device_caps_sysfs(const char *node, DeviceCaps *caps) {
+    if (read_sysfs_caps(node, "ev", caps->ev, NLONGS(EV_CNT)) < 0) return -1;
+    /* Absent bitmaps (no such event type) just stay empty */
+    read_sysfs_caps(node, "key", caps->key, NLONGS(KEY_CNT));
+    read_sysfs_caps(node, "rel", caps->rel, NLONGS(REL_CNT));
+    read_sysfs_caps(node, "abs", caps->abs, NLONGS(ABS_CNT));
+    return 0;
+}
+
+/* Fallback when sysfs isn't available: ask the already opened device */
+static int read_device_caps_ioctl(int fd, DeviceCaps *caps) {
+    memset(caps, 0, sizeof(*caps));
+    if (ioctl(fd, EVIOCGBIT(0, sizeof(caps->ev)), caps->ev) < 0) return -1;
+    ioctl(fd, EVIOCGBIT(EV_KEY, sizeof(caps->key)), caps->key);
+    ioctl(fd, EVIOCGBIT(EV_REL, sizeof(caps->rel)), caps->rel);
+    ioctl(fd, EVIOCGBIT(EV_ABS, sizeof(caps->abs)), caps->abs);
+    return 0;
+}
+
+static int is_input_device(const DeviceCaps *caps, enum kbd_input_class *cls) {
+    /* Check for keyboard - has many keys including letters */
+    if (test_bit_in(caps->ev, EV_KEY)) {
+        /* Check if it has letter keys (A-Z) - indicates a keyboard */
+        int has_letters = 0;
+        for (int k = KEY_Q; k <= KEY_P; k++) {
+            if (test_bit_in(caps->key, k)) {
+                has_letters++;
+            }
+        }
+        if (has_letters >= 5) {
+            *cls = KBD_CLASS_KEYBOARD;
+            return 1;
+        }
+    }
+
+    /* Check for relative X/Y axes (mouse movement) */
+    if (test_bit_in(caps->ev, EV_REL) && test_bit_in(caps->rel, REL_X) && test_bit_in(caps->rel, REL_Y)) {
+        *cls = KBD_CLASS_MOUSE;
+        return 1;
+    }
+
+    /* Check for absolute X/Y axes (touchpad) */
+    if (test_bit_in(caps->ev, EV_ABS) && test_bit_in(caps->abs, ABS_X) && test_bit_in(caps->abs, ABS_Y)) {
+        *cls = KBD_CLASS_TOUCHPAD;
+        return 1;
+    }
+
+    return 0;
+}
+
+static void set_bit_in(unsigned long *bits, int bit) {
+    bits[bit / BITS_PER_LONG] |= 1UL << (bit % BITS_PER_LONG);
+}
+
+/*
+ * Install a kernel-side event mask so only events meaning "user is present"
+ * are queued on our fd: keys/buttons, relative motion and the single-touch
+ * ABS_X/ABS_Y axes. EV_MSC scan codes, LEDs, autorepeat settings and ABS_MT
+ * frames are filtered by evdev, and a frame left empty by the mask is dropped
+ * together with its SYN_REPORT, so it never wakes us up.
+ * EV_SYN itself can't be masked (and is needed for wakeups anyway).
+ * Contact-only touchpads queue just the touch, finger-count and button
+ * edges: a finger sliding across the pad queues nothing until it lifts.
+ */
+static void set_event_mask(int fd, const char *path, int contact_only) {
+#ifdef EVIOCSMASK
+    static const int contact_codes[] = { BTN_LEFT, BTN_RIGHT, BTN_MIDDLE, BTN_TOUCH, BTN_TOOL_DOUBLETAP,
+                                         BTN_TOOL_TRIPLETAP, BTN_TOOL_QUADTAP, BTN_TOOL_QUINTTAP };
+    unsigned long types[EV_CNT / BITS_PER_LONG + 1] = {0};
+    set_bit_in(types, EV_KEY);
+    if (!contact_only) {
+        set_bit_in(types, EV_REL);
+        set_bit_in(types, EV_ABS);
+    }
+
+    struct input_mask mask = {
+        .type = EV_SYN,  /* EV_SYN selects the event type mask */
+        .codes_size = sizeof(types),
+        .codes_ptr = (uintptr_t)types
+    };
+    if (ioctl(fd, EVIOCSMASK, &mask) < 0) {
+        fprintf(stderr, "Event mask not supported on %s: %s (receiving all events)\n",
+                path, strerror(errno));
+        return;
+    }
+
+    if (contact_only) {
+        unsigned long keybits[KEY_CNT / BITS_PER_LONG + 1] = {0};
+        for (size_t i = 0; i < sizeof(contact_codes) / sizeof(contact_codes[0]); i++) {
+            set_bit_in(keybits, contact_codes[i]);
+        }
+        mask.type = EV_KEY;
+        mask.codes_size = sizeof(keybits);
+        mask.codes_ptr = (uintptr_t)keybits;
+        if (ioctl(fd, EVIOCSMASK, &mask) < 0) {
+            fprintf(stderr, "Failed to set key mask on %s: %s\n", path, strerror(errno));
+        }
+        return;
+    }
+
+    unsigned long absbits[ABS_CNT / BITS_PER_LONG + 1] = {0};
+    set_bit_in(absbits, ABS_X);
+    set_bit_in(absbits, ABS_Y);
+
+    mask.type = EV_ABS;
+    mask.codes_size = sizeof(absbits);
+    mask.codes_ptr = (uintptr_t)absbits;
+    if (ioctl(fd, EVIOCSMASK, &mask) < 0) {
+        fprintf(stderr, "Failed to set ABS mask on %s: %s\n", path, strerror(errno));
+    }
+#else
+    (void)fd;
+    (void)path;
+    (void)contact_only;
+#endif
+}
+
+/* Whether input on the device should wake us (otherwise it is read when the dim is due) */
+static int input_watchable(const InputDevice *dev) {
+    return recording || config.roles[dev->cls] == KBD_ROLE_WAKE;
+}
+
+/* Probe a node under INPUT_DEV_PATH and start monitoring it if it's a keyboard/mouse/touchpad */
+static void add_input_device(const char *node) {
+    if (strncmp(node, "event", 5) != 0) return;
+
+    for (int i = 0; i < input_device_count; i++) {
+        if (strcmp(input_devices[i]->node, node) == 0) return;
+    }
+
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%s", INPUT_DEV_PATH, node);
+
+    /*
+     * Classify from sysfs first so devices we ignore are never opened (opening
+     * an evdev node can wake Bluetooth/USB HID devices from runtime suspend).
+     */
+    DeviceCaps caps;
+    KbdDeviceIdent ident;
+    enum kbd_input_class cls = KBD_CLASS_KEYBOARD;
+    int have_caps = read_device_caps_sysfs(node, &caps) == 0;
+    if (have_caps && (!is_input_device(&caps, &cls) || config.roles[cls] == KBD_ROLE_IGNORE)) return;
+    int have_ident = read_device_ident_sysfs(node, &ident) == 0;
+    if (have_ident && !device_allowed(&ident)) {
+        if (verbose) fprintf(stderr, "Skipping %s (%s): excluded by device rules\n", path, ident.name);
+        return;
+    }
+
+    int fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+        return;
+    }
+
+    if (!have_caps && (read_device_caps_ioctl(fd, &caps) < 0 || !is_input_device(&caps, &cls) ||
+                       config.roles[cls] == KBD_ROLE_IGNORE)) {
+        close(fd);
+        return;
+    }
+    if (!have_ident) {
+        read_device_ident_ioctl(fd, &ident);
+        if (!device_allowed(&ident)) {
+            if (verbose) fprintf(stderr, "Skipping %s (%s): excluded by device rules\n", path, ident.name);
+            close(fd);
+            return;
+        }
+    }
+
+    /* Without a working mask contact tracking still holds, motion frames just cost wakeups */
+    int contact_only = config.touchpad_contact_only && cls == KBD_CLASS_TOUCHPAD && test_bit_in(caps.key, BTN_TOUCH);
+    set_event_mask(fd, path, contact_only);
+
+    /*
+     * Stamp events on the monotonic clock, so queued events (debounce, latch)
+     * still say when the user touched something, immune to wall clock steps.
+     */
+    int clock_id = INPUT_CLOCK;
+    int stamped = ioctl(fd, EVIOCSCLOCKID, &clock_id) == 0;
+    if (!stamped) {
+        fprintf(stderr, "Monotonic timestamps not supported on %s: %s (using read time)\n", path, strerror(errno));
+    }
+
+    if (input_device_count == input_device_capacity) {
+        int capacity = input_device_capacity ? input_device_capacity * 2 : 8;
+        InputDevice **table = realloc(input_devices, capacity * sizeof(*table));
+        if (!table) {
+            close(fd);
+            return;
+        }
+        input_devices = table;
+        input_device_capacity = capacity;
+    }
+
+    InputDevice *dev = calloc(1, sizeof(*dev));
+    if (!dev) {
+        close(fd);
+        return;
+    }
+    dev->src.kind = SRC_INPUT;
+    dev->src.fd = fd;
+    strncpy(dev->node, node, sizeof(dev->node) - 1);
+    dev->cls = cls;
+    dev->stamped = stamped;
+    dev->contact.enabled = contact_only;
+    dev->contact.up_us = -1;
+
+    /*
+     * Add fd to epoll - level triggered (unless input is currently unsubscribed).
+     * Keep-alive devices are never watched: their events queue until the dim is due.
+     */
+    if (input_monitoring && input_watchable(dev) && epoll_watch(&dev->src, EPOLLIN) < 0) {
+        fprintf(stderr, "Failed to add %s to epoll: %s\n", path, strerror(errno));
+        close(fd);
+        free(dev);
+        return;
+    }
+
+    input_devices[input_device_count++] = dev;
+    event_log(KBD_EVENT_DEVICE_ADD, dev->src.fd, 0, 0);
+    fprintf(stderr, "Monitoring %s%s%s: %s (%s, %04x:%04x)\n", input_class_names[cls],
+            config.roles[cls] == KBD_ROLE_KEEPALIVE ? " (keep-alive)" : "", contact_only ? " (contacts only)" : "",
+            path, ident.name, ident.vendor, ident.product);
+}
+
+static void remove_input_device(InputDevice *dev) {
+    for (int i = 0; i < input_device_count; i++) {
+        if (input_devices[i] != dev) continue;
+
+        fprintf(stderr, "Device removed: %s/%s\n", INPUT_DEV_PATH, dev->node);
+        event_log(KBD_EVENT_DEVICE_REMOVE, dev->src.fd, 0, 0);
+        metrics.removed_bytes_drained += dev->bytes_drained;
+        metrics.removed_events_drained += dev->events_drained;
+        input_devices[i] = input_devices[--input_device_count];
+#ifdef HAVE_IO_URING
+        if (dev->inflight) {
+            /* The kernel still owns dev->buf: free when the read completes */
+            dev->dead = 1;
+            uring_prep(IORING_OP_ASYNC_CANCEL, -1, dev, 0, NULL);
+            close(dev->src.fd);
+            return;
+        }
+#endif
+        close(dev->src.fd);  /* Also drops it from the epoll set */
+        free(dev);
+        return;
+    }
+}
+
+static void open_input_devices(void) {
+    DIR *dir = opendir(INPUT_DEV_PATH);
+    if (!dir) {
+        fprintf(stderr, "Failed to open %s: %s\n", INPUT_DEV_PATH, strerror(errno));
+        return;
+    }
+
+    /* Create epoll instance */
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        fprintf(stderr, "Failed to create epoll: %s\n", strerror(errno));
+        closedir(dir);
+        return;
+    }
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        add_input_device(entry->d_name);
+    }
+
+    closedir(dir);
+}
+
+/*
+ * Watch INPUT_DEV_PATH for event nodes coming and going, so devices plugged
+ * in later (USB/Bluetooth keyboards, docks) are picked up and only the
+ * changed node is probed. IN_ATTRIB catches nodes whose permissions udev
+ * fixes up after creation.
+ */
+static int setup_hotplug(void) {
+    hotplug_source.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (hotplug_source.fd < 0) {
+        fprintf(stderr, "Failed to create inotify: %s\n", strerror(errno));
+        return -1;
+    }
+
+    if (inotify_add_watch(hotplug_source.fd, INPUT_DEV_PATH, IN_CREATE | IN_ATTRIB | IN_DELETE) < 0 ||
+        epoll_watch(&hotplug_source, EPOLLIN) < 0) {
+        fprintf(stderr, "Failed to watch %s for hotplug: %s\n", INPUT_DEV_PATH, strerror(errno));
+        close(hotplug_source.fd);
+        hotplug_source.fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * The inotify queue overflowed and hotplug events were lost: drop devices
+ * whose node is gone and add the nodes that aren't open yet.
+ */
+static void rescan_input_devices(void) {
+    fprintf(stderr, "Hotplug events lost, rescanning %s\n", INPUT_DEV_PATH);
+    /* Backwards: removal moves the last device into the freed slot */
+    for (int i = input_device_count - 1; i >= 0; i--) {
+        char path[512];
+        snprintf(path, sizeof(path), "%s/%s", INPUT_DEV_PATH, input_devices[i]->node);
+        if (access(path, F_OK) < 0 && errno == ENOENT) {
+            remove_input_device(input_devices[i]);
+        }
+    }
+
+    DIR *dir = opendir(INPUT_DEV_PATH);
+    if (!dir) {
+        fprintf(stderr, "Failed to open %s: %s\n", INPUT_DEV_PATH, strerror(errno));
+        return;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        add_input_device(entry->d_name);
+    }
+    closedir(dir);
+}
+
+static void process_hotplug_events(const char *buf, ssize_t n) {
+    for (const char *p = buf; p < buf + n; ) {
+        const struct inotify_event *ie = (const struct inotify_event *)p;
+        p += sizeof(*ie) + ie->len;
+
+        if (ie->mask & IN_Q_OVERFLOW) {
+            rescan_input_devices();
+            continue;
+        }
+        if (ie->len == 0) continue;
+        if (ie->mask & IN_DELETE) {
+            for (int i = 0; i < input_device_count; i++) {
+                if (strcmp(input_devices[i]->node, ie->name) == 0) {
+                    remove_input_device(input_devices[i]);
+                    break;
+                }
+            }
+        } else {
+            add_input_device(ie->name);
+        }
+    }
+}
+
+static void handle_hotplug(void) {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t n;
+
+    while ((n = read(hotplug_source.fd, buf, sizeof(buf))) > 0) {
+        process_hotplug_events(buf, n);
+    }
+}
+
+/* Add or remove the input fds of wake classes from the epoll set */
+static void set_input_monitoring(int enable) {
+    input_monitoring = enable;
+#ifdef HAVE_IO_URING
+    if (use_uring) {
+        /* Reads are re-posted before the next wait; cancel the ones in flight */
+        for (int i = 0; !enable && i < input_device_count; i++) {
+            if (input_devices[i]->inflight) {
+                uring_prep(IORING_OP_ASYNC_CANCEL, -1, input_devices[i], 0, NULL);
+            }
+        }
+        return;
+    }
+#endif
+    for (int i = 0; i < input_device_count; i++) {
+        if (!input_watchable(input_devices[i])) continue;
+        if (enable) {
+            epoll_watch(&input_devices[i]->src, EPOLLIN);
+        } else {
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, input_devices[i]->src.fd, NULL);
+        }
+    }
+}
+
+#ifdef HAVE_IO_URING
+/* Falling back from io_uring once the sources are open: add what epoll_watch() skipped */
+static int epoll_watch_sources(void) {
+    if (epoll_watch(&timer_source, EPOLLIN) < 0) return -1;
+    if (hotplug_source.fd >= 0 && epoll_watch(&hotplug_source, EPOLLIN) < 0) return -1;
+    if (hw_changed_source.fd >= 0 && epoll_watch(&hw_changed_source, EPOLLPRI) < 0) return -1;
+    if (activity_source.fd >= 0 && epoll_watch(&activity_source, EPOLLIN) < 0) return -1;
+    for (int i = 0; input_monitoring && i < input_device_count; i++) {
+        if (input_watchable(input_devices[i]) && epoll_watch(&input_devices[i]->src, EPOLLIN) < 0) return -1;
+    }
+    return 0;
+}
+#endif
+
+static void trace_write_record(long long t_us, int byte) {
+    /* Devices are read one after the other: an event may predate the last record */
+    if (t_us < trace.prev_us) t_us = trace.prev_us;
+    unsigned long long delta = (unsigned long long)(t_us - trace.prev_us);
+    do {
+        int b = delta & 0x7f;
+        delta >>= 7;
+        fputc(delta ? b | 0x80 : b, trace.f);
+    } while (delta);
+    fputc(byte, trace.f);
+    trace.prev_us = t_us;
+    trace.records++;
+}
+
+/* Record the event types seen in one read from a device */
+static void trace_record_events(const InputDevice *dev, const struct input_event *evs, size_t count) {
+    enum trace_class cls = dev->cls == KBD_CLASS_KEYBOARD ? TC_KEYBOARD
+                         : dev->cls == KBD_CLASS_MOUSE    ? TC_MOUSE
+                                                          : TC_TOUCHPAD;
+    for (size_t i = 0; i < count; i++) {
+        int type = evs[i].type;
+        if (type < EV_KEY || type > EV_ABS) continue;
+        long long t_us = input_event_us(dev, &evs[i]);
+        if (trace.last_us[cls][type] && t_us - trace.last_us[cls][type] < TRACE_RESOLUTION_US) continue;
+        trace.last_us[cls][type] = t_us;
+        trace_write_record(t_us, (cls << 4) | type);
+    }
+}
+
+/* Advance to the next replay record; at the end (or the end marker) next_us becomes -1 */
+static void trace_read_record(void) {
+    unsigned long long delta = 0;
+    int shift = 0, c;
+    while ((c = fgetc(trace.f)) != EOF) {
+        delta |= (unsigned long long)(c & 0x7f) << shift;
+        shift += 7;
+        if (!(c & 0x80) || shift > 56) break;
+    }
+    int byte = c == EOF ? EOF : fgetc(trace.f);
+    if (byte == EOF || (byte & 0x0f) == 0) {
+        trace.end_us = byte == EOF ? trace.prev_us : trace.prev_us + (long long)delta;
+        trace.next_us = -1;
+        return;
+    }
+    trace.prev_us += (long long)delta;
+    trace.next_us = trace.prev_us;
+    trace.next_class = byte >> 4;
+    trace.records++;
+}
+
+static enum kbd_input_class trace_input_class(int tc) {
+    return tc == TC_MOUSE ? KBD_CLASS_MOUSE : tc == TC_TOUCHPAD ? KBD_CLASS_TOUCHPAD : KBD_CLASS_KEYBOARD;
+}
+
+/* Whether the next replay record would wake the daemon, if input is watched */
+static int replay_record_wakes(void) {
+    return config.roles[trace_input_class(trace.next_class)] == KBD_ROLE_WAKE;
+}
+
+/*
+ * Consume the next replay record. Wake input goes to the core; keep-alive
+ * input is held back until the dim is due, like events queued on an
+ * unwatched fd. Returns 1 for wake input.
+ */
+static int replay_consume(KbdCoreInput *in) {
+    enum kbd_input_class cls = trace_input_class(trace.next_class);
+    int wake = config.roles[cls] == KBD_ROLE_WAKE;
+    if (wake) {
+        in->activity_ms[cls] = trace.next_us / 1000;
+    } else if (config.roles[cls] == KBD_ROLE_KEEPALIVE) {
+        trace.keepalive_us[cls] = trace.next_us;
+    }
+    trace_read_record();
+    return wake;
+}
+
+/* Replay counterpart of draining the input fds: consume records up to now */
+static int replay_drain(long long now_us, KbdCoreInput *in) {
+    int had_input = 0;
+    while (trace.next_us >= 0 && trace.next_us <= now_us) {
+        had_input |= replay_consume(in);
+    }
+    return had_input;
+}
+
+static int open_trace(const char *path, const char *mode) {
+    char magic[sizeof(TRACE_MAGIC) - 1];
+    trace.f = fopen(path, mode);
+    if (!trace.f) {
+        fprintf(stderr, "Failed to open trace %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    if (mode[0] == 'w') {
+        fputs(TRACE_MAGIC, trace.f);
+        return 0;
+    }
+    if (fread(magic, 1, sizeof(magic), trace.f) != sizeof(magic) ||
+        memcmp(magic, TRACE_MAGIC, sizeof(magic)) != 0) {
+        fprintf(stderr, "%s is not an activity trace\n", path);
+        fclose(trace.f);
+        trace.f = NULL;
+        return -1;
+    }
+    trace_read_record();
+    return 0;
+}
+
+/*
+ * Drain events queued on one device. Returns 1 if it had events that count
+ * as input. A device that was unplugged (ENODEV) is removed and must not be
+ * used afterwards.
+ */
+static int drain_input_device(InputDevice *dev) {
+    struct input_event ev_buf[64];
+    long bytes = 0;
+    int had_input = 0;
+    ssize_t n;
+    while ((n = read(dev->src.fd, ev_buf, sizeof(ev_buf))) > 0) {
+        had_input |= input_events_seen(dev, ev_buf, n / sizeof(struct input_event));
+        if (trace.f) trace_record_events(dev, ev_buf, n / sizeof(struct input_event));
+        dev->bytes_drained += n;
+        dev->events_drained += n / sizeof(struct input_event);
+        bytes += n;
+    }
+    PROBE2(input_drain, dev->src.fd, bytes);
+    if (bytes > 0) event_log(KBD_EVENT_DRAIN, dev->src.fd, (int)bytes, 0);
+    if (n < 0 && errno == ENODEV) {
+        remove_input_device(dev);
+    }
+    return had_input;
+}
+
+/*
+ * Drain events queued on the input fds of classes with a role. Returns 1 if
+ * any fd had events. With io_uring wake devices aren't drained here: queued
+ * events complete the reads posted on re-arm and count as fresh input.
+ */
+static int drain_input_devices(enum kbd_input_role role) {
+    if (use_uring && role == KBD_ROLE_WAKE) return 0;
+
+    int had_input = 0;
+    for (int i = input_device_count - 1; i >= 0; i--) {
+        if (config.roles[input_devices[i]->cls] != role) continue;
+        had_input |= drain_input_device(input_devices[i]);
+    }
+    return had_input;
+}
+
+/* Touchpad contacts still in progress count as input until they look like a resting palm */
+static void contacts_in_progress(void) {
+    long long now_us = input_clock_us();
+    for (int i = 0; i < input_device_count; i++) {
+        const TouchContact *tc = &input_devices[i]->contact;
+        if (!tc->enabled || !tc->down) continue;
+        long long t = tc->edge_us + config.touchpad_palm_ms * 1000LL;
+        if (t > now_us) t = now_us;
+        if (t > newest_input_us[input_devices[i]->cls]) newest_input_us[input_devices[i]->cls] = t;
+    }
+}
+
+/* Whether any open device has the keep-alive role */
+static int keepalive_devices(void) {
+    for (int i = 0; i < input_device_count; i++) {
+        if (config.roles[input_devices[i]->cls] == KBD_ROLE_KEEPALIVE) return 1;
+    }
+    return 0;
+}
+
+static void close_input_devices(void) {
+    for (int i = 0; i < input_device_count; i++) {
+        close(input_devices[i]->src.fd);
+        free(input_devices[i]);
+    }
+    free(input_devices);
+    input_devices = NULL;
+    input_device_count = 0;
+    input_device_capacity = 0;
+    if (hotplug_source.fd >= 0) {
+        close(hotplug_source.fd);
+        hotplug_source.fd = -1;
+    }
+    if (epoll_fd >= 0) {
+        close(epoll_fd);
+        epoll_fd = -1;
+    }
+}
+
+/*
+ * Watch brightness_hw_changed next to the brightness file, if present.
+ * The LED core sysfs_notify()s it on hardware-initiated changes, which shows
+ * up as EPOLLPRI, so the periodic brightness poll isn't needed.
+ * Returns 1 if the watch is active, 0 if we have to fall back to polling.
+ */
+static int setup_hw_changed_watch(void) {
+    char path[512];
+    snprintf(path, sizeof(path), "%s/brightness_hw_changed", led_dir);
+
+    hw_changed_source.fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (hw_changed_source.fd < 0) return 0;
+
+    /* sysfs only signals changes after the attribute has been read once */
+    char buf[16];
+    if (read(hw_changed_source.fd, buf, sizeof(buf)) < 0) {
+        /* ENODATA until the first hardware change - still armed */
+    }
+
+    if (epoll_watch(&hw_changed_source, EPOLLPRI) < 0) {
+        fprintf(stderr, "Failed to add %s to epoll: %s\n", path, strerror(errno));
+        close(hw_changed_source.fd);
+        hw_changed_source.fd = -1;
+        return 0;
+    }
+    return 1;
+}
+
+/* Re-read brightness_hw_changed so the next notification is delivered */
+static void rearm_hw_changed_watch(void) {
+    char buf[16];
+    if (lseek(hw_changed_source.fd, 0, SEEK_SET) < 0) return;
+    if (read(hw_changed_source.fd, buf, sizeof(buf)) < 0) {}
+}
+
+static char *trim(char *str) {
+    /* Trim leading whitespace */
+    while (*str == ' ' || *str == '\t') str++;
+
+    /* Trim trailing whitespace */
+    char *end = str + strlen(str) - 1;
+    while (end > str && (*end == ' ' || *end == '\t' || *end == '\n' || *end == '\r')) {
+        *end = '\0';
+        end--;
+    }
+    return str;
+}
+
+/* Class of a per-class key such as "mouse_role", -1 if the key isn't one with this suffix */
+static int class_key(const char *key, const char *suffix) {
+    for (int i = 0; i < KBD_CLASS_COUNT; i++) {
+        size_t n = strlen(input_class_names[i]);
+        if (strncmp(key, input_class_names[i], n) == 0 && strcmp(key + n, suffix) == 0) return i;
+    }
+    return -1;
+}
+
+static void load_config(void) {
+    /* Set defaults */
+    strncpy(config.brightness_path, DEFAULT_BRIGHTNESS_PATH, sizeof(config.brightness_path));
+    strncpy(config.max_brightness_path, DEFAULT_MAX_BRIGHTNESS_PATH, sizeof(config.max_brightness_path));
+    strncpy(config.event_ring_path, KBD_EVENTS_PATH, sizeof(config.event_ring_path));
+    strncpy(config.calibration_path, CALIBRATION_PATH, sizeof(config.calibration_path));
+    config.timeout_ms = DEFAULT_TIMEOUT_MS;
+    config.fade_steps = DEFAULT_FADE_STEPS;
+    config.fade_interval_ms = DEFAULT_FADE_INTERVAL_MS;
+    config.target_brightness = -1; /* -1 means use current */
+    config.dim_brightness = 0;
+    config.activity_latch = 0;
+    config.latch_rearm_ms = DEFAULT_LATCH_REARM_MS;
+    config.pattern_fade = 1;
+    config.async_writes = 1;
+    config.bpf_activity = 0;
+    config.touchpad_contact_only = 0;
+    config.touchpad_palm_ms = DEFAULT_TOUCHPAD_PALM_MS;
+    for (int i = 0; i < KBD_CLASS_COUNT; i++) {
+        config.roles[i] = KBD_ROLE_WAKE;
+        config.class_timeout_ms[i] = 0;
+    }
+
+    FILE *f = fopen(config_path, "r");
+    if (!f) {
+        fprintf(stderr, "Config file not found at %s, using defaults\n", config_path);
+        return;
+    }
+
+    fprintf(stderr, "Loading config from %s\n", config_path);
+
+    char line[512];
+    while (fgets(line, sizeof(line), f)) {
+        /* Skip comments and empty lines */
+        char *trimmed = trim(line);
+        if (trimmed[0] == '#' || trimmed[0] == '\0') continue;
+
+        char *eq = strchr(trimmed, '=');
+        if (!eq) continue;
+
+        *eq = '\0';
+        char *key = trim(trimmed);
+        char *value = trim(eq + 1);
+        int cls;
+
+        if (strcmp(key, "brightness_path") == 0) {
+            strncpy(config.brightness_path, value, sizeof(config.brightness_path) - 1);
+        } else if (strcmp(key, "max_brightness_path") == 0) {
+            strncpy(config.max_brightness_path, value, sizeof(config.max_brightness_path) - 1);
+        } else if (strcmp(key, "event_ring") == 0) {
+            /* A path, or "none" to keep no event ring */
+            memset(config.event_ring_path, 0, sizeof(config.event_ring_path));
+            if (strcmp(value, "none") != 0) {
+                strncpy(config.event_ring_path, value, sizeof(config.event_ring_path) - 1);
+            }
+            fprintf(stderr, "  event_ring=%s\n", value);
+        } else if (strcmp(key, "calibration_path") == 0) {
+            /* A path, or "none" to ignore any calibration */
+            memset(config.calibration_path, 0, sizeof(config.calibration_path));
+            if (strcmp(value, "none") != 0) {
+                strncpy(config.calibration_path, value, sizeof(config.calibration_path) - 1);
+            }
+            fprintf(stderr, "  calibration_path=%s\n", value);
+        } else if (strcmp(key, "timeout") == 0) {
+            /* Seconds, fractions allowed (e.g. 0.5) */
+            config.timeout_ms = (int)(strtod(value, NULL) * 1000);
+            fprintf(stderr, "  timeout=%.3gs\n", config.timeout_ms / 1000.0);
+        } else if (strcmp(key, "fade_steps") == 0) {
+            config.fade_steps = atoi(value);
+            fprintf(stderr, "  fade_steps=%d\n", config.fade_steps);
+        } else if (strcmp(key, "fade_interval_ms") == 0) {
+            config.fade_interval_ms = atoi(value);
+            fprintf(stderr, "  fade_interval_ms=%d\n", config.fade_interval_ms);
+        } else if (strcmp(key, "target_brightness") == 0) {
+            config.target_brightness = atoi(value);
+            fprintf(stderr, "  target_brightness=%d\n", config.target_brightness);
+        } else if (strcmp(key, "dim_brightness") == 0) {
+            config.dim_brightness = atoi(value);
+            fprintf(stderr, "  dim_brightness=%d\n", config.dim_brightness);
+        } else if (strcmp(key, "activity_latch") == 0) {
+            config.activity_latch = atoi(value);
+            fprintf(stderr, "  activity_latch=%d\n", config.activity_latch);
+        } else if (strcmp(key, "latch_rearm_ms") == 0) {
+            config.latch_rearm_ms = atoi(value);
+            fprintf(stderr, "  latch_rearm_ms=%d\n", config.latch_rearm_ms);
+        } else if (strcmp(key, "pattern_fade") == 0) {
+            config.pattern_fade = atoi(value);
+            fprintf(stderr, "  pattern_fade=%d\n", config.pattern_fade);
+        } else if (strcmp(key, "async_writes") == 0) {
+            config.async_writes = atoi(value);
+            fprintf(stderr, "  async_writes=%d\n", config.async_writes);
+        } else if (strcmp(key, "bpf_activity") == 0) {
+            config.bpf_activity = atoi(value);
+            fprintf(stderr, "  bpf_activity=%d\n", config.bpf_activity);
+        } else if (strcmp(key, "allow") == 0 || strcmp(key, "deny") == 0) {
+            if (kbd_match_add(value, key[0] == 'd') < 0) {
+                fprintf(stderr, "  %s: bad rule '%s' (expected name:, id: or phys:)\n", key, value);
+            } else {
+                fprintf(stderr, "  %s=%s\n", key, value);
+            }
+        } else if (strcmp(key, "touchpad_contact_only") == 0) {
+            config.touchpad_contact_only = atoi(value);
+            fprintf(stderr, "  touchpad_contact_only=%d\n", config.touchpad_contact_only);
+        } else if (strcmp(key, "touchpad_palm_ms") == 0) {
+            config.touchpad_palm_ms = atoi(value);
+            fprintf(stderr, "  touchpad_palm_ms=%d\n", config.touchpad_palm_ms);
+        } else if ((cls = class_key(key, "_role")) >= 0) {
+            int role = -1;
+            for (int i = 0; i <= KBD_ROLE_IGNORE; i++) {
+                if (strcmp(value, role_names[i]) == 0) role = i;
+            }
+            if (role < 0) {
+                fprintf(stderr, "  %s: unknown role '%s' (expected wake, keepalive or ignore)\n", key, value);
+            } else {
+                config.roles[cls] = role;
+                fprintf(stderr, "  %s=%s\n", key, role_names[role]);
+            }
+        } else if ((cls = class_key(key, "_timeout")) >= 0) {
+            config.class_timeout_ms[cls] = (int)(strtod(value, NULL) * 1000);
+            fprintf(stderr, "  %s=%.3gs\n", key, config.class_timeout_ms[cls] / 1000.0);
+        }
+    }
+
+    fclose(f);
+
+    /* Hashed once here, so a hotplugged device is checked in constant time */
+    if (kbd_match_compile() < 0) {
+        fprintf(stderr, "Failed to build the device rule table, ignoring device rules\n");
+        kbd_match_free();
+    }
+}
+
+/*
+ * Calibration (--calibrate): what each level reads back as once written,
+ * and how long a write takes. Cached in calibration_path for the LED it was
+ * measured on; without it levels are assumed exact and writes instant.
+ */
+typedef struct {
+    int *readback;          /* max_brightness + 1 entries */
+    int distinct;           /* Distinct non-zero levels the LED can show */
+    int write_latency_us;   /* 90th percentile */
+} Calibration;
+
+static Calibration calibration;
+
+static void load_calibration(void) {
+    if (!config.calibration_path[0]) return;
+    FILE *f = fopen(config.calibration_path, "r");
+    if (!f) return;
+
+    char *line = NULL;
+    size_t cap = 0;
+    int max = -1, latency = -1, valid = 1;
+    int *readback = NULL;
+    while (valid && getline(&line, &cap, f) > 0) {
+        char *trimmed = trim(line);
+        if (trimmed[0] == '#' || trimmed[0] == '\0') continue;
+
+        char *eq = strchr(trimmed, '=');
+        if (!eq) continue;
+        *eq = '\0';
+        char *key = trim(trimmed);
+        char *value = trim(eq + 1);
+
+        if (strcmp(key, "brightness_path") == 0) {
+            valid = strcmp(value, config.brightness_path) == 0;
+        } else if (strcmp(key, "max_brightness") == 0) {
+            max = atoi(value);
+            valid = max == max_brightness;
+        } else if (strcmp(key, "write_latency_us") == 0) {
+            latency = atoi(value);
+        } else if (strcmp(key, "readback") == 0 && max >= 0 && !readback) {
+            readback = calloc(max + 1, sizeof(int));
+            char *p = value;
+            for (int i = 0; readback && valid && i <= max; i++) {
+                char *end;
+                long v = strtol(p, &end, 10);
+                valid = end != p && v >= 0 && v <= max;
+                readback[i] = (int)v;
+                p = end;
+            }
+        }
+    }
+    free(line);
+    fclose(f);
+
+    if (!valid || !readback || latency < 0) {
+        fprintf(stderr, "Ignoring %s: measured on another LED or incomplete, run --calibrate again\n",
+                config.calibration_path);
+        free(readback);
+        return;
+    }
+
+    unsigned char *seen = calloc(max + 1, 1);
+    calibration.distinct = 0;
+    for (int i = 1; seen && i <= max; i++) {
+        if (readback[i] > 0 && !seen[readback[i]]) {
+            seen[readback[i]] = 1;
+            calibration.distinct++;
+        }
+    }
+    free(seen);
+    calibration.readback = readback;
+    calibration.write_latency_us = latency;
+}
+
+/*
+ * Fades the hardware can keep up with: a step no shorter than a write, and
+ * no more steps than distinct levels, keeping the configured fade duration.
+ */
+static void calibration_cap_fades(int *steps, int *interval_ms) {
+    if (!calibration.readback) return;
+
+    int duration_ms = *steps * *interval_ms;
+    int min_interval_ms = (calibration.write_latency_us + 999) / 1000;
+    if (*interval_ms < min_interval_ms) {
+        *interval_ms = min_interval_ms;
+    }
+    int max_steps = duration_ms / *interval_ms;
+    if (max_steps > calibration.distinct) max_steps = calibration.distinct;
+    if (max_steps < 1) max_steps = 1;
+    if (*steps > max_steps) {
+        *steps = max_steps;
+    }
+}
+
+static int compare_int(const void *a, const void *b) {
+    return *(const int *)a - *(const int *)b;
+}
+
+/* Write every level, read it back and time the writes; restores the original level */
+static int calibrate(void) {
+    if (!config.calibration_path[0]) {
+        fprintf(stderr, "Calibration failed: calibration_path=none, nowhere to save it\n");
+        return 1;
+    }
+    /* Checked before touching the LED: a fresh install has no state directory yet */
+    char dir[sizeof(config.calibration_path)];
+    strncpy(dir, config.calibration_path, sizeof(dir));
+    if (mkdir(dirname(dir), 0755) < 0 && errno != EEXIST) {
+        fprintf(stderr, "Calibration failed: cannot create %s: %s\n", dir, strerror(errno));
+        return 1;
+    }
+    /* Every exit from here goes through out: the LED gets its level back, the buffers are freed */
+    int ret = 1;
+    int original = read_brightness_fast();
+    int *readback = calloc(max_brightness + 1, sizeof(int));
+    int *latency_us = calloc(max_brightness + 1, sizeof(int));
+    if (!readback || !latency_us || original < 0) {
+        fprintf(stderr, "Calibration failed: %s\n", original < 0 ? "cannot read brightness" : "out of memory");
+        goto out;
+    }
+
+    fprintf(stderr, "Calibrating %s: writing levels 0-%d\n", config.brightness_path, max_brightness);
+    int differ = 0;
+    for (int level = 0; level <= max_brightness && running; level++) {
+        char buf[16];
+        int len = format_level(buf, level);
+        long long start = monotonic_us();
+        if (pwrite(brightness_fd, buf, len, 0) != len) {
+            fprintf(stderr, "Calibration failed: writing %d: %s\n", level, strerror(errno));
+            goto out;
+        }
+        latency_us[level] = (int)(monotonic_us() - start);
+
+        struct timespec ts = { 0, CALIBRATION_SETTLE_MS * 1000000L };
+        nanosleep(&ts, NULL);
+        readback[level] = read_brightness_fast();
+        if (readback[level] < 0 || readback[level] > max_brightness) {
+            fprintf(stderr, "Calibration failed: level %d read back as %d\n", level, readback[level]);
+            goto out;
+        }
+        if (readback[level] != level) {
+            differ++;
+            if (verbose) fprintf(stderr, "  %d reads back as %d\n", level, readback[level]);
+        }
+    }
+    if (!running) goto out;
+
+    qsort(latency_us, max_brightness + 1, sizeof(int), compare_int);
+    int p90 = latency_us[max_brightness * 9 / 10];
+
+    FILE *f = fopen(config.calibration_path, "w");
+    if (!f) {
+        fprintf(stderr, "Failed to write %s: %s\n", config.calibration_path, strerror(errno));
+        goto out;
+    }
+    fprintf(f, "# Written by kbd-backlight-daemon --calibrate\n");
+    fprintf(f, "brightness_path=%s\n", config.brightness_path);
+    fprintf(f, "max_brightness=%d\n", max_brightness);
+    fprintf(f, "write_latency_us=%d\n", p90);
+    fprintf(f, "readback=");
+    for (int i = 0; i <= max_brightness; i++) {
+        fprintf(f, "%s%d", i ? " " : "", readback[i]);
+    }
+    fprintf(f, "\n");
+    if (fclose(f) != 0) {
+        fprintf(stderr, "Failed to write %s: %s\n", config.calibration_path, strerror(errno));
+        goto out;
+    }
+
+    load_calibration();
+    int steps = config.fade_steps, interval_ms = config.fade_interval_ms;
+    calibration_cap_fades(&steps, &interval_ms);
+    fprintf(stderr, "Levels: %d read back differently, %d distinct non-zero\n", differ, calibration.distinct);
+    fprintf(stderr, "Write latency: median %dus, p90 %dus, max %dus\n", latency_us[max_brightness / 2], p90,
+            latency_us[max_brightness]);
+    fprintf(stderr, "Fades: %d steps every %dms (configured: %d every %dms)\n", steps, interval_ms,
+            config.fade_steps, config.fade_interval_ms);
+    fprintf(stderr, "Saved to %s\n", config.calibration_path);
+    ret = 0;
+
+out:
+    if (original >= 0) {
+        char buf[16];
+        int len = format_level(buf, original);
+        if (pwrite(brightness_fd, buf, len, 0) != len) {
+            fprintf(stderr, "Warning: could not restore brightness %d: %s\n", original, strerror(errno));
+        }
+    }
+    free(readback);
+    free(latency_us);
+    return ret;
+}
+
+/* Account the time spent in the previous state and switch to a new one */
+static void metrics_set_state(enum kbd_state state, long long now_ms) {
+    if (state == metrics.state) return;
+    PROBE2(state_change, metrics.state, state);
+    event_log(KBD_EVENT_STATE, metrics.state, state, 0);
+    metrics.state_ms[metrics.state] += now_ms - metrics.state_since_ms;
+    metrics.state = state;
+    metrics.state_since_ms = now_ms;
+}
+
+static void dump_metrics(long long now_ms) {
+    long long state_ms[KBD_STATE_COUNT];
+    memcpy(state_ms, metrics.state_ms, sizeof(state_ms));
+    state_ms[metrics.state] += now_ms - metrics.state_since_ms;
+
+    fprintf(stderr, "Metrics after %.1fs:\n", (now_ms - metrics.start_ms) / 1000.0);
+    fprintf(stderr, "  wakeups: %lu (input %lu, timer %lu, hw_changed %lu, hotplug %lu, other %lu)\n",
+            metrics.wakeups, metrics.wakeups_input, metrics.wakeups_timer,
+            metrics.wakeups_hw_changed, metrics.wakeups_hotplug, metrics.wakeups_other);
+    fprintf(stderr, "  deadlines:");
+    for (int i = 0; i < KBD_DL_COUNT; i++) {
+        fprintf(stderr, "%s %s %lu", i ? "," : "", kbd_deadline_names[i], metrics.deadline_hits[i]);
+    }
+    fprintf(stderr, "\n");
+    unsigned long writer_writes = __atomic_load_n(&writer.writes, __ATOMIC_RELAXED);
+    fprintf(stderr, "  sysfs: %lu reads, %lu writes, %lu syscalls, %lu reads saved by coalescing\n",
+            metrics.sysfs_reads, metrics.sysfs_writes + writer_writes, metrics.sysfs_syscalls + writer_writes,
+            metrics.sysfs_reads_saved);
+    if (config.touchpad_contact_only) {
+        fprintf(stderr, "  touchpad contacts: %lu, %lu flicker releases merged, %lu resting palms ignored\n",
+                metrics.touch_contacts, metrics.touch_flicker, metrics.touch_palms);
+    }
+    if (metrics.keepalive_checks > 0) {
+        fprintf(stderr, "  keep-alive: read at %lu dim deadlines, %lu of them postponed the dim\n",
+                metrics.keepalive_checks, metrics.keepalive_postponed);
+    }
+    fprintf(stderr, "  fades: %lu started (%lu kernel), %lu completed, %lu aborted\n",
+            metrics.fades_started, metrics.fades_kernel, metrics.fades_completed, metrics.fades_aborted);
+    fprintf(stderr, "  time:");
+    for (int i = 0; i < KBD_STATE_COUNT; i++) {
+        fprintf(stderr, "%s %s %.1fs", i ? "," : "", kbd_state_names[i], state_ms[i] / 1000.0);
+    }
+    fprintf(stderr, "\n");
+    for (int i = 0; i < input_device_count; i++) {
+        fprintf(stderr, "  drained %s (%s): %llu bytes, %llu events\n", input_devices[i]->node,
+                input_class_names[input_devices[i]->cls], input_devices[i]->bytes_drained, input_devices[i]->events_drained);
+    }
+    const LatencyHistogram *hists[2] = { &metrics.latency_first, &metrics.latency_full };
+    const char *hist_names[2] = { "first light", "full fade" };
+    for (int i = 0; i < 2; i++) {
+        if (hists[i]->count == 0) continue;
+        fprintf(stderr, "  input-to-%s latency: %lu samples, p50 %.1fms, p99 %.1fms, max %.1fms\n",
+                hist_names[i], hists[i]->count, latency_percentile(hists[i], 50) / 1000.0,
+                latency_percentile(hists[i], 99) / 1000.0, hists[i]->max_us / 1000.0);
+    }
+    if (activity_source.fd >= 0) {
+        static const char *const class_names[KBD_BPF_CLASS_COUNT] = { "key", "rel", "abs" };
+        fprintf(stderr, "  bpf activity: last input");
+        for (int i = 0; i < KBD_BPF_CLASS_COUNT; i++) {
+            long long t = kbd_bpf_last_activity_ms(i);
+            if (t < 0) {
+                fprintf(stderr, "%s %s never", i ? "," : "", class_names[i]);
+            } else {
+                fprintf(stderr, "%s %s %.1fs ago", i ? "," : "", class_names[i], (now_ms - t) / 1000.0);
+            }
+        }
+        fprintf(stderr, "\n");
+    }
+    if (writer.wake_fd >= 0) {
+        fprintf(stderr, "  writer thread: %lu writes (%lu failed), %lu superseded before being written\n",
+                writer_writes, __atomic_load_n(&writer.failed, __ATOMIC_RELAXED), writer.superseded);
+    }
+    if (metrics.removed_bytes_drained > 0) {
+        fprintf(stderr, "  drained (removed devices): %llu bytes, %llu events\n",
+                metrics.removed_bytes_drained, metrics.removed_events_drained);
+    }
+}
+
+static void core_config_init(KbdCoreConfig *cc, int kernel_fades, int poll_external) {
+    cc->timeout_ms = config.timeout_ms;
+    cc->fade_steps = config.fade_steps;
+    cc->fade_interval_ms = config.fade_interval_ms;
+    calibration_cap_fades(&cc->fade_steps, &cc->fade_interval_ms);
+    cc->readback = calibration.readback;
+    cc->target_brightness = config.target_brightness;
+    cc->dim_brightness = config.dim_brightness;
+    cc->max_brightness = max_brightness;
+    cc->activity_latch = config.activity_latch;
+    cc->latch_rearm_ms = config.latch_rearm_ms;
+    cc->kernel_fades = kernel_fades;
+    cc->poll_external = poll_external;
+    for (int i = 0; i < KBD_CLASS_COUNT; i++) {
+        cc->roles[i] = config.roles[i];
+        cc->class_timeout_ms[i] = config.class_timeout_ms[i];
+    }
+}
+
+/* Report the sysfs syscalls a fade cost (verbose mode) */
+static void fade_report(const KbdAction *a) {
+    static const char *const how_names[] = { "done", "interrupted", "cancelled" };
+    if (!verbose) return;
+    fprintf(stderr, "Fade %d -> %d %s (%s): %lu sysfs syscalls\n", a->from, a->level, how_names[a->how],
+            (a->flags & KBD_ACT_KERNEL) ? "kernel" : "userspace", metrics.sysfs_syscalls - fade_syscalls_at_start);
+}
+
+/* Carry out what the core asked for */
+static void apply_actions(KbdActions *out, long long now_ms) {
+    for (int i = 0; i < out->count; i++) {
+        const KbdAction *a = &out->actions[i];
+        switch (a->type) {
+        case KBD_ACT_WRITE:
+            if (a->flags & KBD_ACT_FINAL) latency.final_queued = 1;
+            if (fade_running) PROBE2(fade_step, a->level, (a->flags & KBD_ACT_FINAL) != 0);
+            set_brightness(a->level);
+            break;
+        case KBD_ACT_KERNEL_FADE:
+            if (pattern_fade_start(a->from, a->level, a->duration_ms) == 0) {
+                metrics.fades_kernel++;
+                /* The kernel starts changing the level as soon as the pattern is armed */
+                latency_write_completed(1);
+            } else {
+                KbdActions fallback;
+                kbd_core_kernel_fade_failed(&core, now_ms, &fallback);
+                apply_actions(&fallback, now_ms);
+                out->next_deadline_ms = fallback.next_deadline_ms;
+            }
+            break;
+        case KBD_ACT_KERNEL_FADE_STOP:
+            pattern_trigger_stop();
+            break;
+        case KBD_ACT_WATCH_INPUT:
+            set_input_monitoring(a->level);
+            break;
+        case KBD_ACT_FADE_BEGIN:
+            PROBE4(fade_start, a->from, a->level, (a->flags & KBD_ACT_KERNEL) != 0, (a->flags & KBD_ACT_UNDIM) != 0);
+            fade_running = 1;
+            event_log(KBD_EVENT_FADE_START, a->from, a->level,
+                      ((a->flags & KBD_ACT_KERNEL) ? 1 : 0) | ((a->flags & KBD_ACT_UNDIM) ? 2 : 0));
+            metrics.fades_started++;
+            fade_syscalls_at_start = metrics.sysfs_syscalls;
+            /* Only fades that end a dim because of input are measured */
+            latency.active = (a->flags & KBD_ACT_UNDIM) && wake_input_us >= 0;
+            latency.input_us = wake_input_us;
+            latency.first_done = 0;
+            latency.final_queued = 0;
+            break;
+        case KBD_ACT_FADE_END:
+            PROBE3(fade_end, a->from, a->level, (int)a->how);
+            fade_running = 0;
+            event_log(KBD_EVENT_FADE_END, a->from, a->level, (int)a->how);
+            fade_report(a);
+            if (a->how == KBD_FADE_DONE) {
+                metrics.fades_completed++;
+            } else {
+                metrics.fades_aborted++;
+                latency.active = 0;
+            }
+            break;
+        case KBD_ACT_EXTERNAL_CHANGE:
+            PROBE2(external_change, a->from, a->level);
+            event_log(KBD_EVENT_EXTERNAL, a->from, a->level, 0);
+            current_brightness = a->level;
+            if (a->level > 0) {
+                fprintf(stderr, "External brightness change: %d -> %d (new target)\n", a->from, a->level);
+            } else {
+                fprintf(stderr, "External brightness off: %d -> 0 (user disabled)\n", a->from);
+            }
+            break;
+        }
+    }
+}
+
+/* What a wakeup of the event loop delivered */
+typedef struct {
+    int had_input;
+    int brightness;  /* Fresh brightness reading, -1 if none */
+} Wakeup;
 
-static void set_brightness(int brightness) {
-    if (brightness < 0) brightness = 0;
-    if (brightness > max_brightness) brightness = max_brightness;
+/*
+ * The BPF tracker classifies events by type: keys and buttons count as
+ * keyboard input, relative motion as mouse and absolute as touchpad.
+ */
+static const enum kbd_bpf_class bpf_classes[KBD_CLASS_COUNT] = { KBD_BPF_KEY, KBD_BPF_REL, KBD_BPF_ABS };
 
-    if (brightness != current_brightness) {
-        if (write_int_to_file(config.brightness_path, brightness) == 0) {
-            current_brightness = brightness;
-            last_written_brightness = brightness;
+/*
+ * Why input can't be left to the BPF tracker, NULL if it can. The kprobe
+ * sees every device's events and knows only their type: it can't apply
+ * device rules or contact tracking, and can't tell a mouse button from a
+ * key, or a touchpad from an accelerometer, for per-class roles and timeouts.
+ */
+static const char *bpf_activity_blocker(void) {
+    if (kbd_match_rule_count() > 0) return "allow/deny rules";
+    if (config.touchpad_contact_only) return "touchpad_contact_only";
+    for (int i = 0; i < KBD_CLASS_COUNT; i++) {
+        int timeout_ms = config.class_timeout_ms[i];
+        if (config.roles[i] != KBD_ROLE_WAKE || (timeout_ms > 0 && timeout_ms != config.timeout_ms)) {
+            return "input roles and class timeouts";
         }
     }
+    return NULL;
 }
 
-static void fade_brightness(int from, int to) {
-    if (from == to) return;
+/* Latest input of a class the BPF tracker has seen, -1 without the tracker */
+static long long bpf_last_activity_ms(enum kbd_input_class cls) {
+    return activity_source.fd >= 0 ? kbd_bpf_last_activity_ms(bpf_classes[cls]) : -1;
+}
 
-    int step = (to - from) / config.fade_steps;
-    if (step == 0) step = (to > from) ? 1 : -1;
+/*
+ * Have the BPF tracker wake us on input of wake classes only while dimmed.
+ * Returns 1 if such input already arrived after the dim, before the tracker
+ * was armed.
+ */
+static int activity_arm(int armed) {
+    if (activity_source.fd < 0 || armed == activity_armed) return 0;
+    unsigned classes = 0;
+    for (int i = 0; i < KBD_CLASS_COUNT; i++) {
+        if (config.roles[i] == KBD_ROLE_WAKE) classes |= 1u << bpf_classes[i];
+    }
+    kbd_bpf_arm(armed ? classes : 0);
+    activity_armed = armed;
+    for (int i = 0; armed && i < KBD_CLASS_COUNT; i++) {
+        if (config.roles[i] == KBD_ROLE_WAKE && bpf_last_activity_ms(i) > core.last_input_ms[i]) return 1;
+    }
+    return 0;
+}
 
-    int current = from;
-    struct timespec delay = {
-        .tv_sec = 0,
-        .tv_nsec = config.fade_interval_ms * 1000000L
-    };
+/* epoll backend: wait, dispatch ready sources, then read brightness. Returns 0 on EINTR. */
+static int wait_epoll(Wakeup *w) {
+    struct epoll_event events[MAX_EPOLL_EVENTS];
 
-    while (running) {
-        current += step;
+    int nfds = epoll_wait(epoll_fd, events, MAX_EPOLL_EVENTS, -1);
+    if (nfds < 0) {
+        if (errno == EINTR) return 0;
+        fprintf(stderr, "epoll_wait failed: %s\n", strerror(errno));
+        return -1;
+    }
 
-        if ((step > 0 && current >= to) || (step < 0 && current <= to)) {
-            set_brightness(to);
+    int hotplug_pending = 0;
+    int hw_changed = 0;
+    metrics.wakeups++;
+    for (int i = 0; i < nfds; i++) {
+        EventSource *src = events[i].data.ptr;
+        switch (src->kind) {
+        case SRC_TIMER: {
+            uint64_t expirations;
+            if (read(src->fd, &expirations, sizeof(expirations)) < 0) {}
+            armed_deadline = KBD_NO_DEADLINE;
+            metrics.wakeups_timer++;
+            break;
+        }
+        case SRC_HW_CHANGED:
+            rearm_hw_changed_watch();
+            hw_changed = 1;
+            metrics.wakeups_hw_changed++;
+            break;
+        case SRC_HOTPLUG:
+            /* Handled after the batch: removals would free records still referenced below */
+            hotplug_pending = 1;
+            metrics.wakeups_hotplug++;
+            break;
+        case SRC_WRITER_DONE: {
+            uint64_t n;
+            if (read(src->fd, &n, sizeof(n)) < 0) {}
+            int pending = writer_busy();
+            if (pending && latency.active) writer_want_notify();
+            latency_write_completed(pending);
+            metrics.wakeups_other++;
+            break;
+        }
+        case SRC_ACTIVITY:
+            kbd_bpf_consume();
+            activity_armed = 0;
+            w->had_input = 1;
+            metrics.wakeups_input++;
+            break;
+        case SRC_INPUT:
+            /* Drain input buffer (an unplugged device is removed here) */
+            if (drain_input_device((InputDevice *)src)) w->had_input = 1;
+            metrics.wakeups_input++;
+            break;
+        default:
             break;
         }
+    }
+
+    if (hotplug_pending) {
+        handle_hotplug();
+    }
 
-        set_brightness(current);
-        nanosleep(&delay, NULL);
+    /* Check for external brightness changes when due, or right away when notified */
+    int check = hw_changed ? kbd_core_external_check_allowed(&core)
+                           : kbd_core_external_check_due(&core, get_time_ms());
+    if (check && writer_busy()) {
+        /* The read could overtake the write; take it when the writer reports back */
+        writer_want_notify();
+        if (writer_busy()) check = 0;
     }
+    w->brightness = check ? read_brightness_fast() : -1;
+    if (!check && !writer_busy() && kbd_core_external_check_allowed(&core)) metrics.sysfs_reads_saved++;
+    return 1;
 }
 
-static int is_input_device(const char *path, const char **device_type) {
-    int fd = open(path, O_RDONLY | O_NONBLOCK);
-    if (fd < 0) return 0;
+/* Record mode: log the timing of all input until SIGINT/SIGTERM, touching no backlight */
+static int record_trace(const char *path) {
+    if (open_trace(path, "wb") < 0) {
+        return 1;
+    }
 
-    unsigned long evbits = 0;
-    if (ioctl(fd, EVIOCGBIT(0, sizeof(evbits)), &evbits) < 0) {
-        close(fd);
-        return 0;
+    recording = 1;
+    open_input_devices();
+    if (epoll_fd < 0) {
+        return 1;
+    }
+    int hotplug = setup_hotplug() == 0;
+    if (input_device_count == 0 && !hotplug) {
+        fprintf(stderr, "No keyboard/mouse/touchpad input devices found\n");
+        return 1;
     }
 
-    /* Check for EV_KEY (keyboard/buttons) */
-    int has_key = (evbits & (1 << EV_KEY)) != 0;
-    /* Check for EV_REL (relative movement - mouse) */
-    int has_rel = (evbits & (1 << EV_REL)) != 0;
-    /* Check for EV_ABS (absolute - touchpad) */
-    int has_abs = (evbits & (1 << EV_ABS)) != 0;
+    signal(SIGTERM, signal_handler);
+    signal(SIGINT, signal_handler);
 
-    /* Check for keyboard - has many keys including letters */
-    if (has_key) {
-        unsigned long keybits[KEY_MAX / 8 / sizeof(unsigned long) + 1] = {0};
-        if (ioctl(fd, EVIOCGBIT(EV_KEY, sizeof(keybits)), keybits) >= 0) {
-            /* Check if it has letter keys (A-Z) - indicates a keyboard */
-            int has_letters = 0;
-            for (int k = KEY_Q; k <= KEY_P; k++) {
-                if (keybits[k / (8 * sizeof(unsigned long))] & (1UL << (k % (8 * sizeof(unsigned long))))) {
-                    has_letters++;
-                }
-            }
-            if (has_letters >= 5) {
-                close(fd);
-                *device_type = "keyboard";
-                return 1;
-            }
-        }
-    }
+    trace.prev_us = monotonic_us();
+    long long start_us = trace.prev_us;
+    fprintf(stderr, "Recording input timing from %d devices to %s\n", input_device_count, path);
 
-    /* Check for relative X/Y axes (mouse movement) */
-    if (has_rel) {
-        unsigned long relbits = 0;
-        if (ioctl(fd, EVIOCGBIT(EV_REL, sizeof(relbits)), &relbits) >= 0) {
-            if ((relbits & (1 << REL_X)) && (relbits & (1 << REL_Y))) {
-                close(fd);
-                *device_type = "mouse";
-                return 1;
-            }
+    while (running) {
+        struct epoll_event events[MAX_EPOLL_EVENTS];
+        int nfds = epoll_wait(epoll_fd, events, MAX_EPOLL_EVENTS, -1);
+        if (nfds < 0) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "epoll_wait failed: %s\n", strerror(errno));
+            break;
         }
-    }
 
-    /* Check for absolute X/Y axes (touchpad) */
-    if (has_abs) {
-        unsigned long absbits[2] = {0};
-        if (ioctl(fd, EVIOCGBIT(EV_ABS, sizeof(absbits)), absbits) >= 0) {
-            if ((absbits[0] & (1 << ABS_X)) && (absbits[0] & (1 << ABS_Y))) {
-                close(fd);
-                *device_type = "touchpad";
-                return 1;
+        int hotplug_pending = 0;
+        for (int i = 0; i < nfds; i++) {
+            EventSource *src = events[i].data.ptr;
+            if (src->kind == SRC_HOTPLUG) {
+                hotplug_pending = 1;
+            } else if (src->kind == SRC_INPUT) {
+                drain_input_device((InputDevice *)src);
             }
         }
+        if (hotplug_pending) {
+            handle_hotplug();
+        }
     }
 
-    close(fd);
+    long long end_us = monotonic_us();
+    trace_write_record(end_us, 0);
+    close_input_devices();
+    if (hotplug_source.fd >= 0) {
+        close(hotplug_source.fd);
+    }
+    if (fclose(trace.f) != 0) {
+        fprintf(stderr, "Failed to write trace %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    fprintf(stderr, "Recorded %lu records over %.1fs\n", trace.records - 1, (end_us - start_us) / 1e6);
     return 0;
 }
 
-static void open_input_devices(void) {
-    DIR *dir = opendir(INPUT_DEV_PATH);
-    if (!dir) {
-        fprintf(stderr, "Failed to open %s: %s\n", INPUT_DEV_PATH, strerror(errno));
-        return;
+/*
+ * Replay mode: feed a recorded trace to the policy core on a virtual clock
+ * that jumps to the next deadline or trace record. Writes only go to the
+ * counters, so a day of activity replays in milliseconds.
+ */
+static int replay_trace(const char *path) {
+    if (open_trace(path, "rb") < 0) {
+        return 1;
     }
 
-    /* Create epoll instance */
-    epoll_fd = epoll_create1(0);
-    if (epoll_fd < 0) {
-        fprintf(stderr, "Failed to create epoll: %s\n", strerror(errno));
-        closedir(dir);
-        return;
+    max_brightness = read_int_from_file(config.max_brightness_path);
+    if (max_brightness <= 0) {
+        max_brightness = 100;
+    }
+    if (config.target_brightness < 0) {
+        config.target_brightness = max_brightness / 2;
+    }
+    load_calibration();
+
+    KbdCoreConfig cc;
+    KbdActions out;
+    core_config_init(&cc, config.pattern_fade, 1);
+    long long now_us = 0;
+    kbd_core_init(&core, &cc, config.target_brightness, 0, &out);
+
+    int keepalive_classes = 0;
+    for (int i = 0; i < KBD_CLASS_COUNT; i++) {
+        keepalive_classes |= config.roles[i] == KBD_ROLE_KEEPALIVE;
+        trace.keepalive_us[i] = -1;
     }
 
-    struct dirent *entry;
-    while ((entry = readdir(dir)) != NULL && input_fd_count < MAX_INPUT_DEVICES) {
-        if (strncmp(entry->d_name, "event", 5) != 0) continue;
-
-        char path[512];
-        snprintf(path, sizeof(path), "%s/%s", INPUT_DEV_PATH, entry->d_name);
-
-        const char *device_type = NULL;
-        if (!is_input_device(path, &device_type)) continue;
-
-        int fd = open(path, O_RDONLY | O_NONBLOCK);
-        if (fd < 0) {
-            fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
-            continue;
+    long long real_start_us = monotonic_us();
+    for (;;) {
+        for (int i = 0; i < out.count; i++) {
+            const KbdAction *a = &out.actions[i];
+            metrics.sysfs_writes += a->type == KBD_ACT_WRITE || a->type == KBD_ACT_KERNEL_FADE;
+            metrics.fades_kernel += a->type == KBD_ACT_KERNEL_FADE;
+            metrics.fades_started += a->type == KBD_ACT_FADE_BEGIN;
+            if (a->type == KBD_ACT_FADE_END) {
+                if (a->how == KBD_FADE_DONE) metrics.fades_completed++;
+                else metrics.fades_aborted++;
+            }
         }
+        metrics_set_state(out.state, now_us / 1000);
 
-        /* Add fd to epoll - level triggered */
-        struct epoll_event ev;
-        ev.events = EPOLLIN;
-        ev.data.fd = fd;
-        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
-            fprintf(stderr, "Failed to add %s to epoll: %s\n", path, strerror(errno));
-            close(fd);
-            continue;
+        /* Next wakeup: the core's deadline, or the next record while input is watched */
+        long long next_us = out.next_deadline_ms == KBD_NO_DEADLINE ? -1 : out.next_deadline_ms * 1000;
+        while (trace.next_us >= 0 && (next_us < 0 || trace.next_us < next_us) && !replay_record_wakes()) {
+            /* Keep-alive or ignored input: it never wakes the daemon */
+            replay_consume(NULL);
+        }
+        if (core.input_watched && trace.next_us >= 0 && (next_us < 0 || trace.next_us < next_us)) {
+            next_us = trace.next_us;
+        }
+        if (trace.next_us < 0 && (next_us < 0 || next_us > trace.end_us)) {
+            /* Account the idle tail of the recording before stopping */
+            if (trace.end_us > now_us) now_us = trace.end_us;
+            break;
+        }
+        if (next_us < 0) {
+            next_us = trace.end_us;
+        }
+        if (next_us > now_us) {
+            now_us = next_us;
+        }
+        if (replay_speed > 0) {
+            long long wait_us = real_start_us + (long long)(now_us / replay_speed) - monotonic_us();
+            if (wait_us > 0) {
+                struct timespec ts = { wait_us / 1000000, (wait_us % 1000000) * 1000 };
+                nanosleep(&ts, NULL);
+            }
+        }
+        if (!running) break;
+
+        KbdCoreInput in;
+        kbd_core_input_init(&in, now_us / 1000);
+        if (kbd_core_external_check_due(&core, in.now_ms)) {
+            /* Nobody else touches the fake backlight */
+            in.brightness = core.level;
+            metrics.sysfs_reads++;
+        } else if (kbd_core_external_check_allowed(&core)) {
+            metrics.sysfs_reads_saved++;
+        }
+        if (kbd_core_drain_due(&core, in.now_ms)) {
+            in.drained_input = replay_drain(now_us, &in);
+        } else if (core.input_watched) {
+            in.had_input = replay_drain(now_us, &in);
+        }
+        int keepalive_checked = kbd_core_keepalive_due(&core, in.now_ms) && keepalive_classes;
+        for (int i = 0; keepalive_checked && i < KBD_CLASS_COUNT; i++) {
+            if (trace.keepalive_us[i] >= 0 && trace.keepalive_us[i] / 1000 > in.activity_ms[i]) {
+                in.activity_ms[i] = trace.keepalive_us[i] / 1000;
+            }
+            trace.keepalive_us[i] = -1;
+        }
+        metrics.keepalive_checks += keepalive_checked;
+        kbd_core_step(&core, &in, &out);
+        if (keepalive_checked && out.state == KBD_STATE_ACTIVE) metrics.keepalive_postponed++;
+
+        metrics.wakeups++;
+        if (in.had_input) metrics.wakeups_input++;
+        if (out.expired) metrics.wakeups_timer++;
+        for (int i = 0; i < KBD_DL_COUNT; i++) {
+            if (out.expired & (1u << i)) metrics.deadline_hits[i]++;
         }
-
-        input_fds[input_fd_count++] = fd;
-        fprintf(stderr, "Monitoring %s: %s\n", device_type, path);
     }
 
-    closedir(dir);
+    fclose(trace.f);
+    fprintf(stderr, "Replayed %lu records covering %.1fs in %.1fms\n", trace.records, now_us / 1e6,
+            (monotonic_us() - real_start_us) / 1000.0);
+    dump_metrics(now_us / 1000);
+    return 0;
 }
 
-static void close_input_devices(void) {
-    for (int i = 0; i < input_fd_count; i++) {
-        close(input_fds[i]);
+#ifdef HAVE_IO_URING
+static uint64_t uring_timer_buf;
+static char uring_hotplug_buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+static char uring_hw_changed_buf[16];
+static char uring_brightness_buf[16];
+static EventSource brightness_read_source = { SRC_BRIGHTNESS_READ, -1 };
+static int uring_timer_inflight = 0;
+static int uring_hotplug_inflight = 0;
+static int uring_hw_changed_inflight = 0;
+static int uring_activity_inflight = 0;
+static int uring_read_wanted = 0;  /* hw_changed fired: read even if no check is due */
+static int uring_read_skippable = 0;  /* Timer or input completed: a wakeup that used to read */
+
+/* Post a read (or poll) for every source that doesn't have one outstanding */
+static void uring_post_reads(void) {
+    if (!uring_timer_inflight &&
+        uring_prep(IORING_OP_READ, timer_source.fd, &uring_timer_buf, sizeof(uring_timer_buf), &timer_source)) {
+        uring_timer_inflight = 1;
     }
-    input_fd_count = 0;
-    if (epoll_fd >= 0) {
-        close(epoll_fd);
-        epoll_fd = -1;
+
+    if (hotplug_source.fd >= 0 && !uring_hotplug_inflight &&
+        uring_prep(IORING_OP_READ, hotplug_source.fd, uring_hotplug_buf, sizeof(uring_hotplug_buf),
+                   &hotplug_source)) {
+        uring_hotplug_inflight = 1;
     }
-}
 
-/*
- * Check if brightness was changed externally (e.g., Fn+Space hotkey).
- * Uses polling since the ChromeOS EC doesn't generate uevents.
- * Returns: 1 if turned on externally, 0 if turned off or no change, -1 if turned off externally.
- */
-static int check_external_brightness_change(void) {
-    int actual_brightness = read_brightness_fast();
-    if (actual_brightness < 0) return 0;
-
-    /* Detect external change: brightness differs from what we last wrote */
-    if (last_written_brightness >= 0 && actual_brightness != last_written_brightness) {
-        int old_brightness = last_written_brightness;
-        current_brightness = actual_brightness;
-        last_written_brightness = actual_brightness;
-
-        if (actual_brightness > 0) {
-            /* User turned brightness ON or changed level */
-            config.target_brightness = actual_brightness;
-            fprintf(stderr, "External brightness change: %d -> %d (new target)\n",
-                    old_brightness, actual_brightness);
-            return 1;
-        } else {
-            /* User turned brightness OFF - respect their choice */
-            fprintf(stderr, "External brightness off: %d -> 0 (user disabled)\n", old_brightness);
-            return -1;
+    if (hw_changed_source.fd >= 0 && !uring_hw_changed_inflight) {
+        /* Re-read the attribute to re-arm it, then poll; hard link so ENODATA doesn't break the chain */
+        struct io_uring_sqe *sqe = uring_prep(IORING_OP_READ, hw_changed_source.fd, uring_hw_changed_buf,
+                                              sizeof(uring_hw_changed_buf), NULL);
+        if (sqe) {
+            sqe->flags |= IOSQE_IO_HARDLINK;
+            sqe = uring_prep(IORING_OP_POLL_ADD, hw_changed_source.fd, NULL, 0, &hw_changed_source);
+            if (sqe) {
+                sqe->poll32_events = POLLPRI;
+                uring_hw_changed_inflight = 1;
+            }
         }
     }
 
-    return 0;
-}
+    if (activity_source.fd >= 0 && !uring_activity_inflight) {
+        struct io_uring_sqe *sqe = uring_prep(IORING_OP_POLL_ADD, activity_source.fd, NULL, 0, &activity_source);
+        if (sqe) {
+            sqe->poll32_events = POLLIN;
+            uring_activity_inflight = 1;
+        }
+    }
 
-static char *trim(char *str) {
-    /* Trim leading whitespace */
-    while (*str == ' ' || *str == '\t') str++;
+    for (int i = 0; input_monitoring && i < input_device_count; i++) {
+        InputDevice *dev = input_devices[i];
+        if (input_watchable(dev) && !dev->inflight &&
+            uring_prep(IORING_OP_READ, dev->src.fd, dev->buf, sizeof(dev->buf), dev)) {
+            dev->inflight = 1;
+        }
+    }
 
-    /* Trim trailing whitespace */
-    char *end = str + strlen(str) - 1;
-    while (end > str && (*end == ' ' || *end == '\t' || *end == '\n' || *end == '\r')) {
-        *end = '\0';
-        end--;
+    /* Never read while a write is in flight: it could overtake the write */
+    if (!uring_read_inflight && uring_writes_inflight == 0 &&
+        (uring_read_wanted ? kbd_core_external_check_allowed(&core)
+                           : kbd_core_external_check_due(&core, get_time_ms())) &&
+        uring_prep(IORING_OP_READ, brightness_fd, uring_brightness_buf, sizeof(uring_brightness_buf) - 1,
+                   &brightness_read_source)) {
+        uring_read_inflight = 1;
+        uring_read_stale = 0;
+        uring_read_wanted = 0;
+    } else if (uring_read_skippable && !uring_read_inflight && kbd_core_external_check_allowed(&core)) {
+        metrics.sysfs_reads_saved++;
     }
-    return str;
+    uring_read_skippable = 0;
 }
 
-static void load_config(void) {
-    /* Set defaults */
-    strncpy(config.brightness_path, DEFAULT_BRIGHTNESS_PATH, sizeof(config.brightness_path));
-    strncpy(config.max_brightness_path, DEFAULT_MAX_BRIGHTNESS_PATH, sizeof(config.max_brightness_path));
-    config.timeout_sec = DEFAULT_TIMEOUT_SEC;
-    config.fade_steps = DEFAULT_FADE_STEPS;
-    config.fade_interval_ms = DEFAULT_FADE_INTERVAL_MS;
-    config.target_brightness = -1; /* -1 means use current */
-    config.dim_brightness = 0;
+/* io_uring backend: one io_uring_enter submits queued SQEs and waits. Returns 0 on EINTR. */
+static int wait_uring(Wakeup *w) {
+    uring_post_reads();
 
-    FILE *f = fopen(CONFIG_PATH, "r");
-    if (!f) {
-        fprintf(stderr, "Config file not found at %s, using defaults\n", CONFIG_PATH);
-        return;
+    if (uring_enter(1) < 0) {
+        if (errno == EINTR) return 0;
+        fprintf(stderr, "io_uring_enter failed: %s\n", strerror(errno));
+        return -1;
     }
 
-    fprintf(stderr, "Loading config from %s\n", CONFIG_PATH);
-
-    char line[512];
-    while (fgets(line, sizeof(line), f)) {
-        /* Skip comments and empty lines */
-        char *trimmed = trim(line);
-        if (trimmed[0] == '#' || trimmed[0] == '\0') continue;
-
-        char *eq = strchr(trimmed, '=');
-        if (!eq) continue;
-
-        *eq = '\0';
-        char *key = trim(trimmed);
-        char *value = trim(eq + 1);
+    unsigned head = *ring.cq_head;
+    unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+    metrics.wakeups++;
+    for (; head != tail; head++) {
+        struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+        EventSource *src = (EventSource *)(uintptr_t)cqe->user_data;
+        int res = cqe->res;
+        if (!src) {
+            /* Cancels and the hw_changed re-arm read */
+            metrics.wakeups_other++;
+            continue;
+        }
 
-        if (strcmp(key, "brightness_path") == 0) {
-            strncpy(config.brightness_path, value, sizeof(config.brightness_path) - 1);
-        } else if (strcmp(key, "max_brightness_path") == 0) {
-            strncpy(config.max_brightness_path, value, sizeof(config.max_brightness_path) - 1);
-        } else if (strcmp(key, "timeout") == 0) {
-            config.timeout_sec = atoi(value);
-            fprintf(stderr, "  timeout=%d\n", config.timeout_sec);
-        } else if (strcmp(key, "fade_steps") == 0) {
-            config.fade_steps = atoi(value);
-            fprintf(stderr, "  fade_steps=%d\n", config.fade_steps);
-        } else if (strcmp(key, "fade_interval_ms") == 0) {
-            config.fade_interval_ms = atoi(value);
-            fprintf(stderr, "  fade_interval_ms=%d\n", config.fade_interval_ms);
-        } else if (strcmp(key, "target_brightness") == 0) {
-            config.target_brightness = atoi(value);
-            fprintf(stderr, "  target_brightness=%d\n", config.target_brightness);
-        } else if (strcmp(key, "dim_brightness") == 0) {
-            config.dim_brightness = atoi(value);
-            fprintf(stderr, "  dim_brightness=%d\n", config.dim_brightness);
+        switch (src->kind) {
+        case SRC_TIMER:
+            uring_timer_inflight = 0;
+            armed_deadline = KBD_NO_DEADLINE;
+            uring_read_skippable = 1;
+            metrics.wakeups_timer++;
+            break;
+        case SRC_HOTPLUG:
+            uring_hotplug_inflight = 0;
+            if (res > 0) process_hotplug_events(uring_hotplug_buf, res);
+            metrics.wakeups_hotplug++;
+            break;
+        case SRC_HW_CHANGED:
+            uring_hw_changed_inflight = 0;
+            uring_read_wanted = 1;
+            metrics.wakeups_hw_changed++;
+            break;
+        case SRC_ACTIVITY:
+            uring_activity_inflight = 0;
+            kbd_bpf_consume();
+            activity_armed = 0;
+            w->had_input = 1;
+            uring_read_skippable = 1;
+            metrics.wakeups_input++;
+            break;
+        case SRC_INPUT: {
+            InputDevice *dev = (InputDevice *)src;
+            dev->inflight = 0;
+            if (dev->dead) {
+                free(dev);
+            } else if (res > 0) {
+                if (input_events_seen(dev, dev->buf, res / sizeof(struct input_event))) w->had_input = 1;
+                PROBE2(input_drain, dev->src.fd, res);
+                event_log(KBD_EVENT_DRAIN, dev->src.fd, res, 0);
+                dev->bytes_drained += res;
+                dev->events_drained += res / sizeof(struct input_event);
+                uring_read_skippable = 1;
+                metrics.wakeups_input++;
+            } else if (res == -ENODEV) {
+                remove_input_device(dev);
+            }
+            break;
+        }
+        case SRC_BRIGHTNESS_READ:
+            uring_read_inflight = 0;
+            metrics.sysfs_reads++;
+            metrics.wakeups_other++;
+            if (res > 0 && !uring_read_stale) {
+                uring_brightness_buf[res] = '\0';
+                w->brightness = atoi(uring_brightness_buf);
+            }
+            break;
+        case SRC_BRIGHTNESS_WRITE:
+            uring_writes_inflight--;
+            metrics.wakeups_other++;
+            latency_write_completed(uring_writes_inflight > 0);
+            if (res < 0 && verbose) {
+                fprintf(stderr, "Brightness write failed: %s\n", strerror(-res));
+            }
+            break;
+        default:
+            break;
         }
     }
-
-    fclose(f);
+    __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+    return 1;
 }
+#endif
 
 static void daemonize(void) {
     pid_t pid = fork();
@@ -380,21 +2675,72 @@ static void daemonize(void) {
 
 int main(int argc, char *argv[]) {
     int foreground = 0;
+    const char *record_path = NULL;
+    const char *replay_path = NULL;
+    int calibrate_mode = 0;
 
     for (int i = 1; i < argc; i++) {
         if (strcmp(argv[i], "-f") == 0 || strcmp(argv[i], "--foreground") == 0) {
             foreground = 1;
+        } else if ((strcmp(argv[i], "-b") == 0 || strcmp(argv[i], "--backend") == 0) && i + 1 < argc) {
+            const char *backend = argv[++i];
+            if (strcmp(backend, "io_uring") == 0) {
+                use_uring = 1;
+            } else if (strcmp(backend, "epoll") != 0) {
+                fprintf(stderr, "Unknown backend '%s' (expected epoll or io_uring)\n", backend);
+                return 1;
+            }
+        } else if ((strcmp(argv[i], "-c") == 0 || strcmp(argv[i], "--config") == 0) && i + 1 < argc) {
+            config_path = argv[++i];
+        } else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+            record_path = argv[++i];
+        } else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+            replay_path = argv[++i];
+        } else if (strcmp(argv[i], "--calibrate") == 0) {
+            calibrate_mode = 1;
+        } else if (strcmp(argv[i], "--speed") == 0 && i + 1 < argc) {
+            replay_speed = atof(argv[++i]);
+        } else if (strcmp(argv[i], "-v") == 0 || strcmp(argv[i], "--verbose") == 0) {
+            verbose = 1;
         } else if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
             printf("Usage: %s [OPTIONS]\n", argv[0]);
             printf("Options:\n");
             printf("  -f, --foreground  Run in foreground (don't daemonize)\n");
+            printf("  -b, --backend B   Event loop backend: epoll (default) or io_uring\n");
+            printf("  -c, --config PATH Config file (default: %s)\n", CONFIG_PATH);
+            printf("  --record FILE     Record input timing (no key codes) to FILE until interrupted\n");
+            printf("  --replay FILE     Replay a recorded trace against a fake backlight, then print metrics\n");
+            printf("  --speed N         Pace replay at N times real time (default: as fast as possible)\n");
+            printf("  --calibrate       Measure level quantization and write latency, save to %s\n",
+                   CALIBRATION_PATH);
+            printf("  -v, --verbose     Log each fade and the sysfs syscalls it cost\n");
             printf("  -h, --help        Show this help message\n");
             return 0;
         }
     }
 
+    /* Recording sees the devices the daemon would: same rules, roles and event masks */
     load_config();
 
+    if (record_path) {
+        return record_trace(record_path);
+    }
+
+    if (replay_path) {
+        return replay_trace(replay_path);
+    }
+
+#ifndef HAVE_IO_URING
+    if (use_uring) {
+        fprintf(stderr, "Built without io_uring support, falling back to epoll\n");
+        use_uring = 0;
+    }
+#endif
+
+    char path_buf[sizeof(config.brightness_path)];
+    memcpy(path_buf, config.brightness_path, sizeof(path_buf));
+    strncpy(led_dir, dirname(path_buf), sizeof(led_dir) - 1);
+
     /* Read max brightness */
     max_brightness = read_int_from_file(config.max_brightness_path);
     if (max_brightness <= 0) {
@@ -402,153 +2748,240 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
-    /* Open persistent fd for fast brightness reads */
-    brightness_fd = open(config.brightness_path, O_RDONLY);
+    /* Open persistent fd for fast brightness reads and writes */
+    brightness_fd = open(config.brightness_path, O_RDWR | O_CLOEXEC);
     if (brightness_fd < 0) {
         fprintf(stderr, "Failed to open brightness file %s: %s\n", config.brightness_path, strerror(errno));
         return 1;
     }
 
     /* Read current brightness as target if not configured */
-    current_brightness = read_int_from_file(config.brightness_path);
+    current_brightness = read_brightness_fast();
     if (current_brightness < 0) {
         fprintf(stderr, "Failed to read current brightness from %s\n", config.brightness_path);
         return 1;
     }
 
+    if (calibrate_mode) {
+        signal(SIGTERM, signal_handler);
+        signal(SIGINT, signal_handler);
+        return calibrate();
+    }
+    load_calibration();
+
     if (config.target_brightness < 0) {
         config.target_brightness = current_brightness > 0 ? current_brightness : max_brightness / 2;
     }
 
     fprintf(stderr, "kbd-backlight-daemon starting\n");
-    fprintf(stderr, "Max brightness: %d, Target: %d, Timeout: %ds\n",
-            max_brightness, config.target_brightness, config.timeout_sec);
+    fprintf(stderr, "Max brightness: %d, Target: %d, Timeout: %.3gs\n",
+            max_brightness, config.target_brightness, config.timeout_ms / 1000.0);
+    fprintf(stderr, "Input roles:");
+    for (int i = 0; i < KBD_CLASS_COUNT; i++) {
+        int timeout_ms = config.class_timeout_ms[i] > 0 ? config.class_timeout_ms[i] : config.timeout_ms;
+        fprintf(stderr, "%s %s %s", i ? "," : "", input_class_names[i], role_names[config.roles[i]]);
+        if (config.roles[i] != KBD_ROLE_IGNORE) fprintf(stderr, " (%.3gs)", timeout_ms / 1000.0);
+    }
+    fprintf(stderr, "\n");
 
-    open_input_devices();
+    event_ring_open();
 
-    if (input_fd_count == 0) {
-        fprintf(stderr, "No keyboard/mouse/touchpad input devices found\n");
+    const char *bpf_blocker = bpf_activity_blocker();
+    if (config.bpf_activity && bpf_blocker) {
+        fprintf(stderr, "Warning: bpf_activity ignored: %s need evdev, using it instead\n", bpf_blocker);
+    } else if (config.bpf_activity) {
+        activity_source.fd = kbd_bpf_open(verbose);
+    }
+    if (activity_source.fd >= 0) {
+        /* All input devices at once, from the kernel: no evdev nodes to open or hotplug */
+        epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (epoll_fd < 0 || epoll_watch(&activity_source, EPOLLIN) < 0) {
+            fprintf(stderr, "Failed to watch the BPF ring buffer: %s\n", strerror(errno));
+            return 1;
+        }
+        fprintf(stderr, "Input activity: BPF kprobe on input_event\n");
+    } else {
+        open_input_devices();
+        if (epoll_fd < 0) {
+            return 1;
+        }
+
+        int hotplug = setup_hotplug() == 0;
+        if (input_device_count == 0) {
+            if (!hotplug) {
+                fprintf(stderr, "No keyboard/mouse/touchpad input devices found\n");
+                return 1;
+            }
+            fprintf(stderr, "No keyboard/mouse/touchpad input devices yet, waiting for hotplug\n");
+        }
+    }
+
+    if (setup_timer() < 0) {
         return 1;
     }
 
+    if (config.pattern_fade) {
+        pattern_supported = detect_pattern_trigger();
+    }
+    fprintf(stderr, "Fades: %s\n", pattern_supported ? "kernel pattern trigger" : "userspace");
+    if (calibration.readback) {
+        int steps = config.fade_steps, interval_ms = config.fade_interval_ms;
+        calibration_cap_fades(&steps, &interval_ms);
+        fprintf(stderr, "Calibration: %d distinct levels, writes take %dus, fades %d steps every %dms\n",
+                calibration.distinct, calibration.write_latency_us, steps, interval_ms);
+    }
+
+    int hw_changed_events = setup_hw_changed_watch();
+    if (hw_changed_events) {
+        fprintf(stderr, "External brightness changes: event-driven (brightness_hw_changed)\n");
+    } else {
+        fprintf(stderr, "External brightness changes: polling every %ds active, %ds idle\n",
+                KBD_POLL_INTERVAL_ACTIVE_MS / 1000, KBD_POLL_INTERVAL_IDLE_MS / 1000);
+    }
+
     /* Setup signal handlers */
     signal(SIGTERM, signal_handler);
     signal(SIGINT, signal_handler);
+    signal(SIGUSR1, signal_handler);
 
     if (!foreground) {
         daemonize();
     }
 
-    /* Initial state: brightness on */
-    set_brightness(config.target_brightness);
-
-    time_t last_activity = time(NULL);
-    long long last_input_process_ms = 0;  /* For debouncing */
-    int is_dimmed = 0;
-    int user_disabled = 0;  /* User explicitly turned off backlight */
-
-    /*
-     * Polling strategy for external brightness changes (Fn+Space):
-     * - When active (not dimmed): poll every 1s for hotkey detection
-     * - When dimmed/disabled: poll every 5 seconds (user is away, less urgent)
-     * Note: Fn+Space is handled by the EC and doesn't generate input events,
-     * so we must poll the brightness file to detect changes.
-     */
-    const int POLL_INTERVAL_ACTIVE_MS = 1000;
-    const int POLL_INTERVAL_IDLE_MS = 5000;
+#ifdef HAVE_IO_URING
+    /* After daemonize(): the ring and its kernel workers belong to the task that creates it */
+    if (use_uring && uring_setup() < 0) {
+        fprintf(stderr, "io_uring unavailable (%s), falling back to epoll\n", strerror(errno));
+        use_uring = 0;
+        if (epoll_watch_sources() < 0) {
+            fprintf(stderr, "Failed to add sources to epoll: %s\n", strerror(errno));
+            return 1;
+        }
+    }
+#endif
+    fprintf(stderr, "Event loop: %s\n", use_uring ? "io_uring" : "epoll");
+    event_log(KBD_EVENT_START, getpid(), config.target_brightness, config.timeout_ms);
 
-    struct epoll_event events[MAX_INPUT_DEVICES];
+    /* After daemonize(): threads don't survive fork() */
+    if (!use_uring && config.async_writes && writer_start() == 0) {
+        fprintf(stderr, "Brightness writes: writer thread\n");
+    }
 
-    int in_debounce = 0;  /* Track if we're in debounce period */
+    /* Initial state: brightness on */
+    KbdCoreConfig core_config;
+    KbdActions actions;
+    core_config_init(&core_config, pattern_supported, !hw_changed_events);
+    long long now_ms = get_time_ms();
+    metrics.start_ms = now_ms;
+    metrics.state_since_ms = now_ms;
+    kbd_core_init(&core, &core_config, current_brightness, now_ms, &actions);
+    apply_actions(&actions, now_ms);
+    int activity_raced = 0;
 
     while (running) {
-        long long now_ms = get_time_ms();
-        long long since_last_input = now_ms - last_input_process_ms;
-        int debounce_active = (since_last_input < DEBOUNCE_MS);
-
-        /*
-         * Disable/enable epoll monitoring based on debounce state.
-         * This prevents busy-looping when input data is available but we're debouncing.
-         */
-        if (debounce_active && !in_debounce) {
-            /* Enter debounce: remove fds from epoll */
-            for (int i = 0; i < input_fd_count; i++) {
-                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, input_fds[i], NULL);
-            }
-            in_debounce = 1;
-        } else if (!debounce_active && in_debounce) {
-            /* Exit debounce: re-add fds to epoll and drain buffers */
-            for (int i = 0; i < input_fd_count; i++) {
-                /* Drain any accumulated events */
-                struct input_event ev_buf[64];
-                while (read(input_fds[i], ev_buf, sizeof(ev_buf)) > 0) {}
-
-                struct epoll_event ev;
-                ev.events = EPOLLIN;
-                ev.data.fd = input_fds[i];
-                epoll_ctl(epoll_fd, EPOLL_CTL_ADD, input_fds[i], &ev);
-            }
-            in_debounce = 0;
-        }
-
-        /* Calculate timeout */
-        int timeout_ms;
-        if (debounce_active) {
-            timeout_ms = DEBOUNCE_MS - since_last_input;
-        } else {
-            timeout_ms = (is_dimmed || user_disabled) ? POLL_INTERVAL_IDLE_MS : POLL_INTERVAL_ACTIVE_MS;
+        if (dump_metrics_requested) {
+            dump_metrics_requested = 0;
+            dump_metrics(get_time_ms());
         }
 
-        int nfds = epoll_wait(epoll_fd, events, MAX_INPUT_DEVICES, timeout_ms);
+        deadline_arm(actions.next_deadline_ms);
 
-        time_t now = time(NULL);
-        now_ms = get_time_ms();
-
-        /* Poll for external brightness changes */
-        int brightness_change = check_external_brightness_change();
-        if (brightness_change == 1) {
-            /* User turned ON or changed brightness */
-            last_activity = now;
-            user_disabled = 0;
-            is_dimmed = 0;
-        } else if (brightness_change == -1) {
-            /* User turned OFF brightness - respect their choice */
-            user_disabled = 1;
-            is_dimmed = 0;
+        Wakeup wakeup = { .had_input = 0, .brightness = -1 };
+        int woke = 1;
+        wake_input_us = -1;
+        for (int i = 0; i < KBD_CLASS_COUNT; i++) {
+            newest_input_us[i] = -1;
         }
-
-        if (nfds > 0) {
-            /* Drain all buffers */
-            for (int i = 0; i < nfds; i++) {
-                struct input_event ev_buf[64];
-                while (read(events[i].data.fd, ev_buf, sizeof(ev_buf)) > 0) {}
-            }
-
-            last_input_process_ms = now_ms;
-            last_activity = now;
-
-            /* Only restore brightness if not disabled by user */
-            if (is_dimmed && !user_disabled) {
-                fade_brightness(current_brightness, config.target_brightness);
-                is_dimmed = 0;
+        if (activity_raced) {
+            /* Input landed between the dim and arming the tracker: step again right away */
+            activity_raced = 0;
+        } else
+#ifdef HAVE_IO_URING
+        if (use_uring) {
+            woke = wait_uring(&wakeup);
+        } else
+#endif
+        {
+            woke = wait_epoll(&wakeup);
+        }
+        if (woke < 0) break;
+        if (woke == 0) continue;
+
+        KbdCoreInput in;
+        kbd_core_input_init(&in, get_time_ms());
+        in.had_input = wakeup.had_input;
+        in.brightness = wakeup.brightness;
+        if (kbd_core_drain_due(&core, in.now_ms)) {
+            /* End of a debounce or latch window: collect what queued up meanwhile */
+            in.drained_input = drain_input_devices(KBD_ROLE_WAKE);
+        }
+        int keepalive_checked = kbd_core_keepalive_due(&core, in.now_ms) && keepalive_devices();
+        if (keepalive_checked) {
+            /* The dim is due: see whether keep-alive input queued up since the last look */
+            drain_input_devices(KBD_ROLE_KEEPALIVE);
+            metrics.keepalive_checks++;
+        }
+        contacts_in_progress();
+        /* When the newest event happened, not when we got to read it */
+        for (int i = 0; i < KBD_CLASS_COUNT; i++) {
+            in.activity_ms[i] = bpf_last_activity_ms(i);
+            if (newest_input_us[i] >= 0 && newest_input_us[i] / 1000 > in.activity_ms[i]) {
+                in.activity_ms[i] = newest_input_us[i] / 1000;
             }
         }
+        kbd_core_step(&core, &in, &actions);
+        if (keepalive_checked && actions.state == KBD_STATE_ACTIVE) metrics.keepalive_postponed++;
+        PROBE3(wakeup, in.had_input, actions.expired, in.brightness);
+        event_log(KBD_EVENT_WAKEUP, in.had_input, (int)actions.expired, in.brightness);
 
-        /* Check for timeout (inactivity) - only if not already dimmed and not user-disabled */
-        if (!is_dimmed && !user_disabled && (now - last_activity) >= config.timeout_sec) {
-            fade_brightness(current_brightness, config.dim_brightness);
-            is_dimmed = 1;
+        for (int i = 0; i < KBD_DL_COUNT; i++) {
+            if (actions.expired & (1u << i)) metrics.deadline_hits[i]++;
         }
+        apply_actions(&actions, in.now_ms);
+        metrics_set_state(actions.state, in.now_ms);
+        activity_raced = activity_arm(actions.state == KBD_STATE_DIMMED);
     }
 
+    writer_stop();
+    dump_metrics(get_time_ms());
+
     /* Cleanup */
+#ifdef HAVE_IO_URING
+    if (use_uring) {
+        /* Let queued writes land before the synchronous ones below */
+        Wakeup wakeup;
+        while (uring_writes_inflight > 0 && wait_uring(&wakeup) >= 0) {}
+        use_uring = 0;
+    }
+#endif
     close_input_devices();
+    if (timer_source.fd >= 0) {
+        close(timer_source.fd);
+    }
+    if (hw_changed_source.fd >= 0) {
+        close(hw_changed_source.fd);
+    }
+    if (activity_source.fd >= 0) {
+        kbd_bpf_close();
+        activity_source.fd = -1;
+    }
+    kbd_match_free();
+#ifdef HAVE_IO_URING
+    if (ring.fd >= 0) {
+        close(ring.fd);
+    }
+#endif
+
+    /*
+     * Restore brightness on exit (through brightness_fd, so before closing it).
+     * A kernel fade still running is stopped first so it can't override it.
+     */
+    pattern_trigger_stop();
+    set_brightness(core.cfg.target_brightness);
+    event_log(KBD_EVENT_EXIT, 0, 0, 0);
     if (brightness_fd >= 0) {
         close(brightness_fd);
     }
 
-    /* Restore brightness on exit */
-    set_brightness(config.target_brightness);
-
     return 0;
 }
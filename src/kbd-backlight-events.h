@@ -0,0 +1,84 @@
+/*
+ * kbd-backlight-events - Layout of the daemon's shared-memory event ring
+ *
+ * The daemon maps KBD_EVENTS_PATH (or its event_ring= path) and appends a
+ * fixed-size record for each decision it takes; tools/kbd-backlight-events.c
+ * maps the same file read-only and decodes it. Appending is a handful of
+ * stores: no locks and no syscalls (the timestamp comes from the vDSO clock).
+ * There is a single writer: the daemon holds flock(LOCK_EX) on the file.
+ *
+ * A record's seq is its index + 1 and is stored last, after zeroing it
+ * first, so a reader that sees seq != index + 1 knows the slot is being
+ * rewritten and skips it.
+ */
+
+#ifndef KBD_BACKLIGHT_EVENTS_H
+#define KBD_BACKLIGHT_EVENTS_H
+
+#include <stdint.h>
+
+#include "kbd-backlight-core.h"
+
+#define KBD_EVENTS_DIR "/run/kbd-backlight-daemon"
+#define KBD_EVENTS_PATH KBD_EVENTS_DIR "/events"
+#define KBD_EVENTS_MAGIC 0x313054564544424BULL  /* "KBDEVT01" little-endian */
+#define KBD_EVENTS_VERSION 1
+#define KBD_EVENTS_CAPACITY 8192  /* Records; a power of two. Minutes of history at typical rates */
+
+enum kbd_event_type {
+    KBD_EVENT_START = 1,       /* a: pid, b: target level, c: timeout ms */
+    KBD_EVENT_WAKEUP,          /* a: input seen, b: expired mask of enum kbd_deadline, c: brightness reading or -1 */
+    KBD_EVENT_DRAIN,           /* a: fd, b: bytes */
+    KBD_EVENT_EXTERNAL,        /* a: old level, b: new level */
+    KBD_EVENT_FADE_START,      /* a: from, b: to, c: 1 kernel | 2 undim */
+    KBD_EVENT_FADE_END,        /* a: from, b: to, c: enum kbd_fade_end */
+    KBD_EVENT_WRITE,           /* a: level, b: 1 written, 0 unchanged, -1 failed */
+    KBD_EVENT_STATE,           /* a: old state, b: new state (enum kbd_state) */
+    KBD_EVENT_DEVICE_ADD,      /* a: fd */
+    KBD_EVENT_DEVICE_REMOVE,   /* a: fd */
+    KBD_EVENT_EXIT,
+    KBD_EVENT_TYPE_COUNT
+};
+
+/* Names for the core values records carry, shared by the daemon's log and the decoder */
+static const char *const kbd_state_names[KBD_STATE_COUNT] = {
+    [KBD_STATE_ACTIVE] = "active",
+    [KBD_STATE_DIMMED] = "dimmed",
+    [KBD_STATE_USER_DISABLED] = "user-disabled",
+};
+
+static const char *const kbd_deadline_names[KBD_DL_COUNT] = {
+    [KBD_DL_DIM] = "dim",
+    [KBD_DL_POLL] = "poll",
+    [KBD_DL_DEBOUNCE] = "debounce",
+    [KBD_DL_REARM] = "rearm",
+    [KBD_DL_FADE] = "fade",
+};
+
+static const char *const kbd_fade_end_names[] = {
+    [KBD_FADE_DONE] = "done",
+    [KBD_FADE_INTERRUPTED] = "interrupted",
+    [KBD_FADE_CANCELLED] = "cancelled",
+};
+
+typedef struct {
+    uint64_t seq;
+    int64_t time_us;  /* CLOCK_MONOTONIC */
+    uint32_t type;
+    int32_t a;
+    int32_t b;
+    int32_t c;
+} KbdEventRecord;
+
+typedef struct {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t capacity;
+    uint32_t record_size;
+    uint32_t reserved;
+    uint64_t head;  /* Records ever appended; the next one goes to head % capacity */
+    uint8_t pad[32];
+    KbdEventRecord records[KBD_EVENTS_CAPACITY];
+} KbdEventRing;
+
+#endif
@@ -0,0 +1,164 @@
+/*
+ * kbd-backlight-match - Input device allow/deny rules
+ *
+ * See kbd-backlight-match.h. A rule is stored as one key string, a kind
+ * byte ('n'ame, 'i'd, 'p'hys) followed by the value, ids normalized to
+ * lowercase "vvvv:pppp" or "vvvv". The table is open addressing with linear
+ * probing on a 64-bit FNV-1a hash, at most half full.
+ */
+
+#include "kbd-backlight-match.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#define MATCH_KEY_LEN 300  /* Bytes in a key: the kind byte, a value of up to 298 characters and the NUL */
+
+typedef struct {
+    uint64_t hash;
+    char *key;
+    int allow;
+    int deny;
+} Rule;
+
+static Rule *rules = NULL;
+static int rule_count = 0;
+static int rule_capacity = 0;
+static int allow_count = 0;
+static Rule **table = NULL;
+static size_t table_mask = 0;
+
+static uint64_t hash_key(const char *key) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (const unsigned char *p = (const unsigned char *)key; *p; p++) {
+        h ^= *p;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+/* Normalize "id:" rule values; -1 if malformed */
+static int id_key(char *key, const char *value) {
+    char *end;
+    unsigned long vendor = strtoul(value, &end, 16);
+    if (end == value || vendor > 0xffff) return -1;
+    if (*end == '\0') {
+        snprintf(key, MATCH_KEY_LEN, "i%04lx", vendor);
+        return 0;
+    }
+    if (*end != ':') return -1;
+
+    const char *p = end + 1;
+    unsigned long product = strtoul(p, &end, 16);
+    if (end == p || *end != '\0' || product > 0xffff) return -1;
+    snprintf(key, MATCH_KEY_LEN, "i%04lx:%04lx", vendor, product);
+    return 0;
+}
+
+int kbd_match_add(const char *rule, int deny) {
+    char key[MATCH_KEY_LEN];
+    if (strncmp(rule, "name:", 5) == 0 && rule[5]) {
+        /* Too long to store is too long for any device name or phys: reject rather than truncate */
+        if (snprintf(key, sizeof(key), "n%s", rule + 5) >= (int)sizeof(key)) return -1;
+    } else if (strncmp(rule, "phys:", 5) == 0 && rule[5]) {
+        if (snprintf(key, sizeof(key), "p%s", rule + 5) >= (int)sizeof(key)) return -1;
+    } else if (strncmp(rule, "id:", 3) != 0 || id_key(key, rule + 3) < 0) {
+        return -1;
+    }
+
+    if (rule_count == rule_capacity) {
+        int capacity = rule_capacity ? rule_capacity * 2 : 8;
+        Rule *grown = realloc(rules, capacity * sizeof(*grown));
+        if (!grown) return -1;
+        rules = grown;
+        rule_capacity = capacity;
+    }
+    char *copy = strdup(key);
+    if (!copy) return -1;
+
+    Rule *r = &rules[rule_count++];
+    r->hash = hash_key(key);
+    r->key = copy;
+    r->allow = !deny;
+    r->deny = deny;
+    allow_count += !deny;
+    return 0;
+}
+
+int kbd_match_compile(void) {
+    free(table);
+    table = NULL;
+    if (rule_count == 0) return 0;
+
+    size_t size = 8;
+    while (size < (size_t)rule_count * 2) size <<= 1;
+    table = calloc(size, sizeof(*table));
+    if (!table) return -1;
+    table_mask = size - 1;
+
+    for (int i = 0; i < rule_count; i++) {
+        Rule *r = &rules[i];
+        size_t slot = r->hash & table_mask;
+        while (table[slot]) {
+            Rule *t = table[slot];
+            if (t->hash == r->hash && strcmp(t->key, r->key) == 0) {
+                /* The same key allowed and denied: both are kept, deny wins on lookup */
+                t->allow |= r->allow;
+                t->deny |= r->deny;
+                break;
+            }
+            slot = (slot + 1) & table_mask;
+        }
+        if (!table[slot]) table[slot] = r;
+    }
+    return 0;
+}
+
+int kbd_match_rule_count(void) {
+    return rule_count;
+}
+
+int kbd_match_allow_count(void) {
+    return allow_count;
+}
+
+static const Rule *lookup(const char *key) {
+    uint64_t h = hash_key(key);
+    for (size_t slot = h & table_mask; table[slot]; slot = (slot + 1) & table_mask) {
+        if (table[slot]->hash == h && strcmp(table[slot]->key, key) == 0) return table[slot];
+    }
+    return NULL;
+}
+
+enum kbd_match_verdict kbd_match_device(const KbdDeviceIdent *ident) {
+    if (!table) return KBD_MATCH_NONE;
+
+    char keys[4][MATCH_KEY_LEN];
+    int n = 0;
+    if (ident->name[0]) snprintf(keys[n++], MATCH_KEY_LEN, "n%s", ident->name);
+    if (ident->phys[0]) snprintf(keys[n++], MATCH_KEY_LEN, "p%s", ident->phys);
+    snprintf(keys[n++], MATCH_KEY_LEN, "i%04x:%04x", ident->vendor & 0xffff, ident->product & 0xffff);
+    snprintf(keys[n++], MATCH_KEY_LEN, "i%04x", ident->vendor & 0xffff);
+
+    int allow = 0;
+    for (int i = 0; i < n; i++) {
+        const Rule *r = lookup(keys[i]);
+        if (!r) continue;
+        if (r->deny) return KBD_MATCH_DENY;
+        allow |= r->allow;
+    }
+    return allow ? KBD_MATCH_ALLOW : KBD_MATCH_NONE;
+}
+
+void kbd_match_free(void) {
+    for (int i = 0; i < rule_count; i++) {
+        free(rules[i].key);
+    }
+    free(rules);
+    free(table);
+    rules = NULL;
+    table = NULL;
+    rule_count = rule_capacity = allow_count = 0;
+}
@@ -0,0 +1,39 @@
+/*
+ * kbd-backlight-match - Input device allow/deny rules
+ *
+ * Rules match a device's name, vendor:product id or phys path exactly. They
+ * are compiled once into a hash table, so checking a device costs four
+ * lookups however many rules the config holds.
+ */
+
+#ifndef KBD_BACKLIGHT_MATCH_H
+#define KBD_BACKLIGHT_MATCH_H
+
+enum kbd_match_verdict {
+    KBD_MATCH_NONE,   /* No rule names the device */
+    KBD_MATCH_ALLOW,
+    KBD_MATCH_DENY,   /* Wins over any allow rule */
+};
+
+typedef struct {
+    char name[256];   /* EVIOCGNAME */
+    char phys[256];   /* EVIOCGPHYS, empty for virtual devices */
+    unsigned vendor;  /* EVIOCGID */
+    unsigned product;
+} KbdDeviceIdent;
+
+/* Add a rule: "name:<name>", "id:<vendor>:<product>", "id:<vendor>" (hex) or "phys:<phys>". -1 if malformed or too long */
+int kbd_match_add(const char *rule, int deny);
+
+/* Build the lookup table from the rules added so far */
+int kbd_match_compile(void);
+
+/* Number of rules, and of allow rules: with any, unmatched devices are skipped */
+int kbd_match_rule_count(void);
+int kbd_match_allow_count(void);
+
+enum kbd_match_verdict kbd_match_device(const KbdDeviceIdent *ident);
+
+void kbd_match_free(void);
+
+#endif
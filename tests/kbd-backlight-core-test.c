@@ -0,0 +1,360 @@
+/*
+ * kbd-backlight-core-test - Checks for the policy core
+ *
+ * Feeds KbdCoreInput sequences to kbd_core_step() on a virtual clock and
+ * checks the actions it returns: dim, undim, debounce, activity latch,
+ * external changes and aborted fades. Run with `make check`.
+ */
+
+#include "../src/kbd-backlight-core.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#define TARGET 80
+#define TIMEOUT_MS 5000
+#define FADE_STEPS 4
+#define FADE_INTERVAL_MS 50
+#define FADE_MS (FADE_STEPS * FADE_INTERVAL_MS)
+
+static int checks = 0;
+static int failures = 0;
+
+#define CHECK(cond) do { \
+        checks++; \
+        if (!(cond)) { \
+            failures++; \
+            fprintf(stderr, "%s:%d: %s: check failed: %s\n", __FILE__, __LINE__, __func__, #cond); \
+        } \
+    } while (0)
+
+/* A core and what its actions did so far */
+typedef struct {
+    KbdCore core;
+    KbdActions out;
+    long long now_ms;
+    long long queued_ms;  /* Newest key left queued on an unwatched fd, -1 if none */
+    int fades_started;
+    int fades_undim;
+    int fades_done;
+    int fades_aborted;
+    int externals;
+    int watch_changes;
+} Sim;
+
+static KbdCoreConfig default_config(void) {
+    KbdCoreConfig cfg;
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.timeout_ms = TIMEOUT_MS;
+    cfg.fade_steps = FADE_STEPS;
+    cfg.fade_interval_ms = FADE_INTERVAL_MS;
+    cfg.target_brightness = TARGET;
+    cfg.dim_brightness = 0;
+    cfg.max_brightness = 100;
+    cfg.latch_rearm_ms = 1000;
+    for (int i = 0; i < KBD_CLASS_COUNT; i++) {
+        cfg.roles[i] = KBD_ROLE_WAKE;
+    }
+    return cfg;
+}
+
+static void tally(Sim *s) {
+    for (int i = 0; i < s->out.count; i++) {
+        const KbdAction *a = &s->out.actions[i];
+        if (a->type == KBD_ACT_FADE_BEGIN) {
+            s->fades_started++;
+            s->fades_undim += (a->flags & KBD_ACT_UNDIM) != 0;
+        } else if (a->type == KBD_ACT_FADE_END) {
+            if (a->how == KBD_FADE_DONE) s->fades_done++;
+            else s->fades_aborted++;
+        } else if (a->type == KBD_ACT_EXTERNAL_CHANGE) {
+            s->externals++;
+        } else if (a->type == KBD_ACT_WATCH_INPUT) {
+            s->watch_changes++;
+        }
+    }
+}
+
+/* Starts from off, so the core's first write is one a reading can be compared with */
+static void sim_init(Sim *s, const KbdCoreConfig *cfg) {
+    memset(s, 0, sizeof(*s));
+    s->queued_ms = -1;
+    kbd_core_init(&s->core, cfg, 0, 0, &s->out);
+    tally(s);
+}
+
+static int has_action(const Sim *s, enum kbd_action_type type, int level) {
+    for (int i = 0; i < s->out.count; i++) {
+        if (s->out.actions[i].type == type && s->out.actions[i].level == level) return 1;
+    }
+    return 0;
+}
+
+static void sim_step(Sim *s, const KbdCoreInput *in) {
+    s->now_ms = in->now_ms;
+    kbd_core_step(&s->core, in, &s->out);
+    tally(s);
+}
+
+/*
+ * A wakeup at now_ms with keyboard input from key_ms (-1: none), delivered as
+ * the daemon would: woken by it if watched, drained if the core asks for a drain.
+ */
+static void sim_wakeup(Sim *s, long long now_ms, long long key_ms, int brightness) {
+    KbdCoreInput in;
+    kbd_core_input_init(&in, now_ms);
+    in.brightness = brightness;
+    if (key_ms >= 0) {
+        in.activity_ms[KBD_CLASS_KEYBOARD] = key_ms;
+        if (kbd_core_drain_due(&s->core, now_ms)) in.drained_input = 1;
+        else in.had_input = s->core.input_watched;
+    }
+    sim_step(s, &in);
+}
+
+/*
+ * Step through every deadline up to until_ms, draining queued keys and
+ * reading the (unchanged) level when asked to
+ */
+static void sim_run(Sim *s, long long until_ms) {
+    while (s->out.next_deadline_ms != KBD_NO_DEADLINE && s->out.next_deadline_ms <= until_ms) {
+        long long at = s->out.next_deadline_ms;
+        long long key_ms = -1;
+        if (s->queued_ms >= 0 && kbd_core_drain_due(&s->core, at)) {
+            key_ms = s->queued_ms;
+            s->queued_ms = -1;
+        }
+        sim_wakeup(s, at, key_ms, kbd_core_external_check_due(&s->core, at) ? s->core.level : -1);
+    }
+}
+
+/* Keys every period_ms from first_ms to last_ms: each wakes the core or queues */
+static void sim_type(Sim *s, long long first_ms, long long last_ms, long long period_ms) {
+    for (long long key = first_ms; key <= last_ms; key += period_ms) {
+        sim_run(s, key - 1);
+        if (s->core.input_watched) {
+            sim_wakeup(s, key, key, -1);
+        } else {
+            s->queued_ms = key;
+        }
+    }
+}
+
+static void test_dim(void) {
+    KbdCoreConfig cfg = default_config();
+    Sim s;
+    sim_init(&s, &cfg);
+    CHECK(s.out.next_deadline_ms == TIMEOUT_MS);
+
+    sim_run(&s, TIMEOUT_MS - 1);
+    CHECK(s.fades_started == 0);
+    CHECK(s.out.state == KBD_STATE_ACTIVE);
+
+    sim_run(&s, TIMEOUT_MS + FADE_MS);
+    CHECK(s.fades_started == 1 && s.fades_done == 1);
+    CHECK(s.core.level == 0);
+    CHECK(s.out.state == KBD_STATE_DIMMED);
+    CHECK(s.out.next_deadline_ms == KBD_NO_DEADLINE);
+}
+
+static void test_undim(void) {
+    KbdCoreConfig cfg = default_config();
+    Sim s;
+    sim_init(&s, &cfg);
+    sim_run(&s, 6000);
+
+    sim_wakeup(&s, 7000, 7000, -1);
+    CHECK(s.fades_undim == 1);
+    CHECK(s.out.state == KBD_STATE_ACTIVE);
+    sim_run(&s, 7000 + FADE_MS);
+    CHECK(s.core.level == TARGET);
+
+    /* The next dim counts from the input that ended this one */
+    sim_run(&s, 7000 + TIMEOUT_MS - 1);
+    CHECK(s.fades_started == 2);
+    sim_run(&s, 7000 + TIMEOUT_MS);
+    CHECK(s.fades_started == 3 && s.out.state == KBD_STATE_DIMMED);
+}
+
+static void test_debounce(void) {
+    KbdCoreConfig cfg = default_config();
+    Sim s;
+    sim_init(&s, &cfg);
+
+    sim_wakeup(&s, 1000, 1000, -1);
+    CHECK(has_action(&s, KBD_ACT_WATCH_INPUT, 0));
+    CHECK(s.out.next_deadline_ms == 1000 + KBD_DEBOUNCE_MS);
+    CHECK(!kbd_core_drain_due(&s.core, 1000 + KBD_DEBOUNCE_MS - 1));
+    CHECK(kbd_core_drain_due(&s.core, 1000 + KBD_DEBOUNCE_MS));
+
+    /* Input queued during the debounce moves the dim deadline by its timestamp */
+    sim_wakeup(&s, 1000 + KBD_DEBOUNCE_MS, 1150, -1);
+    CHECK(has_action(&s, KBD_ACT_WATCH_INPUT, 1));
+    CHECK(s.out.next_deadline_ms == 1150 + TIMEOUT_MS);
+    sim_run(&s, 1150 + TIMEOUT_MS + FADE_MS);
+    CHECK(s.fades_started == 1 && s.fades_done == 1);
+}
+
+static void test_aborted_fade(void) {
+    KbdCoreConfig cfg = default_config();
+    Sim s;
+    sim_init(&s, &cfg);
+    sim_run(&s, TIMEOUT_MS + FADE_INTERVAL_MS);
+    CHECK(s.fades_started == 1 && s.fades_done == 0);
+
+    /* Input halfway through the dim reverses it from the level reached */
+    sim_wakeup(&s, TIMEOUT_MS + FADE_INTERVAL_MS + 10, TIMEOUT_MS + FADE_INTERVAL_MS + 10, -1);
+    CHECK(s.fades_aborted == 1);
+    CHECK(s.fades_undim == 1);
+    sim_run(&s, TIMEOUT_MS + 2 * FADE_MS);
+    CHECK(s.core.level == TARGET);
+    CHECK(s.out.state == KBD_STATE_ACTIVE);
+}
+
+static void test_external_change(void) {
+    KbdCoreConfig cfg = default_config();
+    cfg.poll_external = 1;
+    Sim s;
+    sim_init(&s, &cfg);
+
+    /* A new level becomes the target and restarts the timeout */
+    sim_wakeup(&s, 1000, -1, 40);
+    CHECK(s.externals == 1 && has_action(&s, KBD_ACT_EXTERNAL_CHANGE, 40));
+    CHECK(s.core.cfg.target_brightness == 40);
+    CHECK(s.core.active_until_ms == 1000 + TIMEOUT_MS);
+    sim_run(&s, 1000 + TIMEOUT_MS + FADE_MS);
+    CHECK(s.out.state == KBD_STATE_DIMMED);
+    sim_wakeup(&s, 8000, 8000, 0);
+    sim_run(&s, 8000 + FADE_MS);
+    CHECK(s.core.level == 40);
+
+    /* The user turned it off: no dim, and input doesn't turn it back on */
+    sim_wakeup(&s, 9000, -1, 0);
+    CHECK(s.out.state == KBD_STATE_USER_DISABLED);
+    sim_wakeup(&s, 10000, 10000, -1);
+    sim_run(&s, 20000);
+    CHECK(s.out.state == KBD_STATE_USER_DISABLED);
+    CHECK(s.fades_started == 2);
+
+    /* A level read back as the driver quantizes it is not a change */
+    static const int readback[101] = { [80] = 78 };
+    cfg.readback = readback;
+    sim_init(&s, &cfg);
+    sim_wakeup(&s, 1000, -1, TARGET);
+    sim_wakeup(&s, 2000, -1, TARGET - 2);
+    CHECK(s.externals == 0);
+}
+
+/* A poll that a kernel fade kept from being made is put off, not dropped */
+static void test_poll_after_kernel_fade(void) {
+    KbdCoreConfig cfg = default_config();
+    cfg.timeout_ms = 30000;
+    cfg.kernel_fades = 1;
+    cfg.poll_external = 1;
+    Sim s;
+    sim_init(&s, &cfg);
+    sim_run(&s, 31000);
+    CHECK(s.out.state == KBD_STATE_DIMMED);
+
+    sim_wakeup(&s, 35000, 35000, -1);
+    CHECK(s.fades_undim == 1);
+    int polled = 1;
+    for (long long t = 35000; t < 64000; t += 100) {
+        sim_run(&s, t);
+        if (s.out.state == KBD_STATE_ACTIVE && s.core.deadlines[KBD_DL_POLL] == KBD_NO_DEADLINE) polled = 0;
+    }
+    CHECK(polled);
+    CHECK(s.out.state == KBD_STATE_ACTIVE);
+    CHECK(s.core.last_check_ms >= 63000);
+}
+
+static void test_latch(void) {
+    KbdCoreConfig cfg = default_config();
+    cfg.activity_latch = 1;
+    Sim s;
+    sim_init(&s, &cfg);
+
+    sim_wakeup(&s, 1000, 1000, -1);
+    CHECK(has_action(&s, KBD_ACT_WATCH_INPUT, 0));
+    CHECK(s.core.latched);
+    CHECK(s.core.deadlines[KBD_DL_REARM] == 1000 + TIMEOUT_MS - cfg.latch_rearm_ms);
+
+    /* Input queued meanwhile renews the latch without watching input */
+    sim_wakeup(&s, 5000, 4000, -1);
+    CHECK(s.core.latched && !s.core.input_watched);
+    CHECK(s.core.deadlines[KBD_DL_REARM] == 4000 + TIMEOUT_MS - cfg.latch_rearm_ms);
+
+    /* Nothing queued: watch input again before the dim */
+    sim_run(&s, 8000);
+    CHECK(!s.core.latched && s.core.input_watched);
+    CHECK(s.fades_started == 0);
+    sim_run(&s, 9000 + FADE_MS);
+    CHECK(s.fades_started == 1 && s.fades_done == 1);
+
+    /* Steady typing: a few wakeups per timeout window, one dim at the end */
+    sim_init(&s, &cfg);
+    sim_type(&s, 1000, 30000, 100);
+    sim_run(&s, 40000);
+    CHECK(s.fades_started == 1 && s.fades_aborted == 0);
+    CHECK(s.watch_changes <= 2 * (30000 / TIMEOUT_MS + 1));
+}
+
+/* The re-arm point must stay ahead of the dim deadline, or the core dims with input queued */
+static void test_latch_drains_before_dim(void) {
+    KbdCoreConfig cfg = default_config();
+    cfg.activity_latch = 1;
+    Sim s;
+    sim_init(&s, &cfg);
+
+    /* A key queued right after the one that latched pushes the dim past the re-arm */
+    sim_wakeup(&s, 1000, 1000, -1);
+    sim_wakeup(&s, 5000, 1100, -1);
+    CHECK(s.core.deadlines[KBD_DL_REARM] < s.core.active_until_ms);
+    sim_type(&s, 6000, 7000, 1000);
+    sim_run(&s, 20000);
+    CHECK(s.fades_started == 1 && s.fades_aborted == 0);
+
+    /* Re-arm due with the dim: queued input is drained first and postpones it */
+    cfg.latch_rearm_ms = 0;
+    sim_init(&s, &cfg);
+    sim_wakeup(&s, 1000, 1000, -1);
+    CHECK(s.out.next_deadline_ms == 1000 + TIMEOUT_MS);
+    CHECK(kbd_core_drain_due(&s.core, 1000 + TIMEOUT_MS));
+    sim_wakeup(&s, 1000 + TIMEOUT_MS, 5500, -1);
+    CHECK(s.fades_started == 0);
+    CHECK(s.core.active_until_ms == 5500 + TIMEOUT_MS);
+}
+
+static void test_class_timeout(void) {
+    KbdCoreConfig cfg = default_config();
+    cfg.activity_latch = 1;
+    cfg.class_timeout_ms[KBD_CLASS_KEYBOARD] = 2000;
+    Sim s;
+    sim_init(&s, &cfg);
+
+    /* Past the initial timeout, so the keyboard's 2s set the dim deadline */
+    sim_wakeup(&s, 4000, 4000, -1);
+    CHECK(s.core.active_until_ms == 6000);
+    CHECK(s.core.deadlines[KBD_DL_REARM] == 5000);
+
+    sim_init(&s, &cfg);
+    sim_type(&s, 1000, 30000, 300);
+    CHECK(s.fades_started == 0);
+    sim_run(&s, 40000);
+    CHECK(s.fades_started == 1 && s.fades_aborted == 0);
+}
+
+int main(void) {
+    test_dim();
+    test_undim();
+    test_debounce();
+    test_aborted_fade();
+    test_external_change();
+    test_poll_after_kernel_fade();
+    test_latch();
+    test_latch_drains_before_dim();
+    test_class_timeout();
+
+    printf("%d checks, %d failed\n", checks, failures);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,175 @@
+/*
+ * kbd-backlight-match-test - Checks for the device allow/deny rules
+ *
+ * Adds rules, compiles the table and checks the verdicts kbd_match_device()
+ * gives: each rule form, deny over allow, a table with many colliding
+ * entries, and the longest rule a key can hold. Run with `make check`.
+ */
+
+#include "../src/kbd-backlight-match.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#define KEY_LEN 300  /* MATCH_KEY_LEN in kbd-backlight-match.c: kind byte, value, NUL */
+#define VALUE_MAX (KEY_LEN - 2)
+
+static int checks = 0;
+static int failures = 0;
+
+#define CHECK(cond) do { \
+        checks++; \
+        if (!(cond)) { \
+            failures++; \
+            fprintf(stderr, "%s:%d: %s: check failed: %s\n", __FILE__, __LINE__, __func__, #cond); \
+        } \
+    } while (0)
+
+static KbdDeviceIdent device(const char *name, const char *phys, unsigned vendor, unsigned product) {
+    KbdDeviceIdent ident;
+    memset(&ident, 0, sizeof(ident));
+    snprintf(ident.name, sizeof(ident.name), "%s", name);
+    snprintf(ident.phys, sizeof(ident.phys), "%s", phys);
+    ident.vendor = vendor;
+    ident.product = product;
+    return ident;
+}
+
+static enum kbd_match_verdict verdict(const char *name, const char *phys, unsigned vendor, unsigned product) {
+    KbdDeviceIdent ident = device(name, phys, vendor, product);
+    return kbd_match_device(&ident);
+}
+
+static void test_no_rules(void) {
+    CHECK(kbd_match_compile() == 0);
+    CHECK(kbd_match_rule_count() == 0);
+    CHECK(verdict("AT Translated Set 2 keyboard", "isa0060/serio0/input0", 0x0001, 0x0001) == KBD_MATCH_NONE);
+    kbd_match_free();
+}
+
+static void test_rule_forms(void) {
+    CHECK(kbd_match_add("name:Yubico YubiKey OTP+FIDO+CCID", 1) == 0);
+    CHECK(kbd_match_add("id:046D:C52B", 0) == 0);  /* Hex in either case */
+    CHECK(kbd_match_add("id:1209", 0) == 0);       /* Any product of the vendor */
+    CHECK(kbd_match_add("phys:usb-0000:00:14.0-3/input0", 0) == 0);
+    CHECK(kbd_match_compile() == 0);
+    CHECK(kbd_match_rule_count() == 4);
+    CHECK(kbd_match_allow_count() == 3);
+
+    CHECK(verdict("Yubico YubiKey OTP+FIDO+CCID", "", 0x1050, 0x0407) == KBD_MATCH_DENY);
+    CHECK(verdict("Yubico YubiKey", "", 0x1050, 0x0407) == KBD_MATCH_NONE);  /* Names match exactly */
+    CHECK(verdict("Logitech USB Receiver", "", 0x046d, 0xc52b) == KBD_MATCH_ALLOW);
+    CHECK(verdict("Logitech USB Receiver", "", 0x046d, 0xc52c) == KBD_MATCH_NONE);
+    CHECK(verdict("Virtual keyboard", "", 0x1209, 0x0001) == KBD_MATCH_ALLOW);
+    CHECK(verdict("Virtual mouse", "", 0x1209, 0xbeef) == KBD_MATCH_ALLOW);
+    CHECK(verdict("Dock keyboard", "usb-0000:00:14.0-3/input0", 0x2222, 0x3333) == KBD_MATCH_ALLOW);
+    CHECK(verdict("Dock keyboard", "usb-0000:00:14.0-3/input1", 0x2222, 0x3333) == KBD_MATCH_NONE);
+    kbd_match_free();
+}
+
+static void test_malformed(void) {
+    CHECK(kbd_match_add("name:", 0) < 0);
+    CHECK(kbd_match_add("phys:", 0) < 0);
+    CHECK(kbd_match_add("id:", 0) < 0);
+    CHECK(kbd_match_add("id:xyz", 0) < 0);
+    CHECK(kbd_match_add("id:10000", 0) < 0);
+    CHECK(kbd_match_add("id:046d:", 0) < 0);
+    CHECK(kbd_match_add("id:046d:c52b:1", 0) < 0);
+    CHECK(kbd_match_add("vendor:046d", 0) < 0);
+    CHECK(kbd_match_rule_count() == 0);
+    kbd_match_free();
+}
+
+static void test_deny_wins(void) {
+    /* Different keys of one device: any deny wins */
+    CHECK(kbd_match_add("id:046d", 0) == 0);
+    CHECK(kbd_match_add("name:Logitech MX Keys", 1) == 0);
+    /* The same key both allowed and denied */
+    CHECK(kbd_match_add("phys:usb-1/input0", 0) == 0);
+    CHECK(kbd_match_add("phys:usb-1/input0", 1) == 0);
+    CHECK(kbd_match_compile() == 0);
+
+    CHECK(verdict("Logitech MX Keys", "", 0x046d, 0xb35b) == KBD_MATCH_DENY);
+    CHECK(verdict("Logitech MX Master", "", 0x046d, 0xb034) == KBD_MATCH_ALLOW);
+    CHECK(verdict("Some keyboard", "usb-1/input0", 0x1111, 0x2222) == KBD_MATCH_DENY);
+    kbd_match_free();
+}
+
+static void test_many_rules(void) {
+    /* Thousands of keys in a table at most half full: probes wrap and collide */
+    char rule[64];
+    int rejected = 0;
+    for (int i = 0; i < 3000; i++) {
+        snprintf(rule, sizeof(rule), "name:device %d", i);
+        if (kbd_match_add(rule, i % 3 == 0) < 0) rejected++;
+    }
+    CHECK(rejected == 0);
+    CHECK(kbd_match_compile() == 0);
+    CHECK(kbd_match_rule_count() == 3000);
+
+    int wrong = 0;
+    char name[64];
+    for (int i = 0; i < 3000; i++) {
+        snprintf(name, sizeof(name), "device %d", i);
+        enum kbd_match_verdict expect = i % 3 == 0 ? KBD_MATCH_DENY : KBD_MATCH_ALLOW;
+        if (verdict(name, "", 0x1111, 0x2222) != expect) wrong++;
+    }
+    CHECK(wrong == 0);
+    CHECK(verdict("device 3000", "", 0x1111, 0x2222) == KBD_MATCH_NONE);
+    CHECK(verdict("device", "", 0x1111, 0x2222) == KBD_MATCH_NONE);
+    kbd_match_free();
+
+    /* The smallest table (8 slots) at its half-full limit: misses still end on a free slot */
+    for (int i = 0; i < 4; i++) {
+        snprintf(rule, sizeof(rule), "id:%04x", 0x1000 + i);
+        CHECK(kbd_match_add(rule, 0) == 0);
+    }
+    CHECK(kbd_match_compile() == 0);
+    CHECK(verdict("x", "", 0x1003, 0x0001) == KBD_MATCH_ALLOW);
+    CHECK(verdict("x", "", 0x2000, 0x0001) == KBD_MATCH_NONE);
+    kbd_match_free();
+}
+
+static void test_key_length(void) {
+    char rule[KEY_LEN + 16];
+    char value[KEY_LEN + 8];
+
+    /* The longest value a key holds */
+    memset(value, 'p', VALUE_MAX);
+    value[VALUE_MAX] = '\0';
+    snprintf(rule, sizeof(rule), "phys:%s", value);
+    CHECK(kbd_match_add(rule, 0) == 0);
+
+    /* One more character would be truncated: rejected instead */
+    memset(value, 'q', VALUE_MAX + 1);
+    value[VALUE_MAX + 1] = '\0';
+    snprintf(rule, sizeof(rule), "name:%s", value);
+    CHECK(kbd_match_add(rule, 0) < 0);
+    snprintf(rule, sizeof(rule), "phys:%s", value);
+    CHECK(kbd_match_add(rule, 0) < 0);
+
+    /* The longest name a device reports matches in full, and only in full */
+    char name[sizeof(((KbdDeviceIdent *)0)->name)];
+    memset(name, 'n', sizeof(name) - 1);
+    name[sizeof(name) - 1] = '\0';
+    snprintf(rule, sizeof(rule), "name:%s", name);
+    CHECK(kbd_match_add(rule, 1) == 0);
+    CHECK(kbd_match_compile() == 0);
+    CHECK(kbd_match_rule_count() == 2);
+    CHECK(verdict(name, "", 0x1111, 0x2222) == KBD_MATCH_DENY);
+    name[sizeof(name) - 2] = '\0';
+    CHECK(verdict(name, "", 0x1111, 0x2222) == KBD_MATCH_NONE);
+    kbd_match_free();
+}
+
+int main(void) {
+    test_no_rules();
+    test_rule_forms();
+    test_malformed();
+    test_deny_wins();
+    test_many_rules();
+    test_key_length();
+
+    printf("%d checks, %d failed\n", checks, failures);
+    return failures ? 1 : 0;
+}
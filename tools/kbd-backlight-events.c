@@ -0,0 +1,161 @@
+/*
+ * kbd-backlight-events - Decode the daemon's shared-memory event ring
+ *
+ * Maps the ring read-only and prints the most recent events, with times
+ * relative to now. The daemon is never contacted; this works on a live
+ * daemon, a hung one, or the file a crashed one left behind.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "../src/kbd-backlight-events.h"
+
+#define FOLLOW_INTERVAL_MS 100
+
+static long long monotonic_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static const char *state_name(int state) {
+    return state >= 0 && state < KBD_STATE_COUNT ? kbd_state_names[state] : "?";
+}
+
+static void print_record(const KbdEventRecord *r, long long now_us) {
+    printf("%12.3fs  ", (r->time_us - now_us) / 1e6);
+    switch (r->type) {
+    case KBD_EVENT_START:
+        printf("start        pid %d, target %d, timeout %dms\n", r->a, r->b, r->c);
+        break;
+    case KBD_EVENT_WAKEUP:
+        printf("wakeup      %s", r->a ? " input" : "");
+        for (int i = 0; i < KBD_DL_COUNT; i++) {
+            if (r->b & (1 << i)) printf(" %s", kbd_deadline_names[i]);
+        }
+        if (!r->a && !r->b) printf(" other");
+        if (r->c >= 0) printf(", read %d", r->c);
+        printf("\n");
+        break;
+    case KBD_EVENT_DRAIN:
+        printf("drain        fd %d, %d bytes (%d events)\n", r->a, r->b, r->b / 24);
+        break;
+    case KBD_EVENT_EXTERNAL:
+        printf("external     %d -> %d%s\n", r->a, r->b, r->b > 0 ? " (new target)" : " (user disabled)");
+        break;
+    case KBD_EVENT_FADE_START:
+        printf("fade start   %d -> %d (%s%s)\n", r->a, r->b, (r->c & 1) ? "kernel" : "userspace",
+               (r->c & 2) ? ", undim" : "");
+        break;
+    case KBD_EVENT_FADE_END:
+        printf("fade end     %d -> %d %s\n", r->a, r->b, r->c >= 0 && r->c <= KBD_FADE_CANCELLED ? kbd_fade_end_names[r->c] : "?");
+        break;
+    case KBD_EVENT_WRITE:
+        printf("write        %d%s\n", r->a, r->b < 0 ? " FAILED" : "");
+        break;
+    case KBD_EVENT_STATE:
+        printf("state        %s -> %s\n", state_name(r->a), state_name(r->b));
+        break;
+    case KBD_EVENT_DEVICE_ADD:
+        printf("device add   fd %d\n", r->a);
+        break;
+    case KBD_EVENT_DEVICE_REMOVE:
+        printf("device gone  fd %d\n", r->a);
+        break;
+    case KBD_EVENT_EXIT:
+        printf("exit\n");
+        break;
+    default:
+        printf("unknown type %u (%d, %d, %d)\n", r->type, r->a, r->b, r->c);
+        break;
+    }
+}
+
+/* Print records [from, to); returns the first index not printed */
+static uint64_t print_range(const KbdEventRing *ring, uint64_t from, uint64_t to) {
+    long long now_us = monotonic_us();
+    for (uint64_t i = from; i < to; i++) {
+        const KbdEventRecord *slot = &ring->records[i & (KBD_EVENTS_CAPACITY - 1)];
+        KbdEventRecord r;
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != i + 1) continue;
+        memcpy(&r, slot, sizeof(r));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        /* Overwritten while copying: the writer lapped us */
+        if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != i + 1) continue;
+        print_record(&r, now_us);
+    }
+    fflush(stdout);
+    return to;
+}
+
+static void usage(const char *prog) {
+    printf("Usage: %s [OPTIONS] [FILE]\n", prog);
+    printf("Options:\n");
+    printf("  -n N          Print the last N events (default: all in the ring)\n");
+    printf("  -f, --follow  Keep printing new events\n");
+    printf("  -h, --help    Show this help message\n");
+    printf("FILE defaults to %s\n", KBD_EVENTS_PATH);
+}
+
+int main(int argc, char *argv[]) {
+    const char *path = KBD_EVENTS_PATH;
+    long long count = KBD_EVENTS_CAPACITY;
+    int follow = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            count = atoll(argv[++i]);
+        } else if (strcmp(argv[i], "-f") == 0 || strcmp(argv[i], "--follow") == 0) {
+            follow = 1;
+        } else if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
+            usage(argv[0]);
+            return 0;
+        } else if (argv[i][0] != '-') {
+            path = argv[i];
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    const KbdEventRing *ring = mmap(NULL, sizeof(KbdEventRing), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ring == MAP_FAILED) {
+        fprintf(stderr, "Failed to map %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    if (ring->magic != KBD_EVENTS_MAGIC || ring->version != KBD_EVENTS_VERSION ||
+        ring->capacity != KBD_EVENTS_CAPACITY || ring->record_size != sizeof(KbdEventRecord)) {
+        fprintf(stderr, "%s is not a compatible event ring\n", path);
+        return 1;
+    }
+
+    if (count > KBD_EVENTS_CAPACITY) count = KBD_EVENTS_CAPACITY;
+    if (count < 0) count = 0;
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint64_t next = print_range(ring, head > (uint64_t)count ? head - count : 0, head);
+
+    while (follow) {
+        struct timespec ts = { 0, FOLLOW_INTERVAL_MS * 1000000L };
+        nanosleep(&ts, NULL);
+        head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        if (head - next > KBD_EVENTS_CAPACITY) {
+            printf("... %llu events lost\n", (unsigned long long)(head - next - KBD_EVENTS_CAPACITY));
+            next = head - KBD_EVENTS_CAPACITY;
+        }
+        next = print_range(ring, next, head);
+    }
+    return 0;
+}